@@ -0,0 +1,33 @@
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+extern "C" {
+    double sum(const double *xs, int64_t n);
+    int64_t dot(const int64_t *xs, int64_t n, const int64_t *ys, int64_t m);
+    int64_t axpy(int64_t a, const int64_t *xs, int64_t n, int64_t *ys, int64_t m);
+    double sqrtAll(const double *xs, int64_t n, double *out, int64_t m);
+}
+
+int main() {
+    std::vector<double> xs = {1.0, 2.0, 3.0, 4.0, 5.0};
+    std::vector<int64_t> a = {1, 2, 3, 4}, b = {5, 6, 7, 8};
+
+    std::cout << "sum = " << sum(xs.data(), xs.size()) << std::endl;
+    std::cout << "dot = " << dot(a.data(), a.size(), b.data(), b.size()) << std::endl;
+    axpy(2, a.data(), a.size(), b.data(), b.size());
+    std::cout << "axpy =";
+    for (int64_t v : b)
+        std::cout << " " << v;
+    std::cout << std::endl;
+
+    std::vector<double> roots(xs.size());
+    sqrtAll(xs.data(), xs.size(), roots.data(), roots.size());
+    std::cout << "sqrt =" << std::setprecision(10);
+    for (double r : roots)
+        std::cout << " " << r;
+    std::cout << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+// frontbench - コンパイラの各フェーズのスループットを測るベンチマーク
+//
+// MCのプログラム(普通はmcgenで生成したもの)を読み、次の各フェーズを別々に測る。
+//   lex:     Lexer::gettokで全トークンを読む(tokens/s)
+//   parse:   全てのdefをASTにする(nodes/s)
+//   codegen: 各defを意味解析してLLVM IRにする(functions/s)
+//   emit:    Moduleを最適化してオブジェクトファイルにする(秒)
+// ROUNDS回繰り返してフェーズ毎に一番速かった回を取り、結果を一行のJSONで標準出力に
+// 書く。リリース毎の結果を並べて比べられるよう、キーの名前は変えないこと。
+//
+//   $ make bench
+//   $ ./frontbench [-O0|-O1|-O2|-O3] [-n ROUNDS] bench.mc
+#define MC_NO_MAIN
+#include "../src/mc.cpp"
+
+#include "llvm/Support/JSON.h"
+
+// Phase - 一つのフェーズの結果(処理した数と、一番速かった回の秒数)
+struct Phase {
+    uint64_t count = 0;
+    double seconds = 0;
+
+    void record(uint64_t n, std::chrono::steady_clock::time_point start) {
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        if (seconds == 0 || d.count() < seconds)
+            seconds = d.count();
+        count = n;
+    }
+    double rate() const { return seconds > 0 ? count / seconds : 0; }
+};
+
+static Phase Lex, Parse, Codegen, Emit;
+
+// runRound - sourceを一回コンパイルし、各フェーズの時間を記録する。
+static bool runRound(StringRef source, const std::string &objPath) {
+    resetCompilation();
+    lexer.initBuffer(source);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t tokens = 0;
+    while (lexer.gettok() != tok_eof)
+        tokens++;
+    Lex.record(tokens, start);
+
+    // MainLoopと同じ順にパースするが、codegenはせずにASTを取っておく。
+    resetCompilation();
+    lexer.initBuffer(source);
+    start = std::chrono::steady_clock::now();
+    std::vector<FunctionAST *> functions;
+    getNextToken();
+    while (CurTok != tok_eof) {
+        if (CurTok == ';') {
+            getNextToken();
+            continue;
+        }
+        FunctionAST *FnAST = CurTok == tok_def ? ParseDefinition() : ParseTopLevelExpr();
+        if (FnAST)
+            functions.push_back(FnAST);
+        else
+            getNextToken();
+    }
+    Parse.record(ASTCtx.getNumNodes(), start);
+
+    InitializeModule();
+    start = std::chrono::steady_clock::now();
+    uint64_t generated = 0;
+    for (FunctionAST *FnAST : functions) {
+        if (FnAST->codegen()) {
+            FunctionDefs[FnAST->getProto().getName()] = FnAST;
+            generated++;
+        }
+    }
+    Codegen.record(generated, start);
+
+    start = std::chrono::steady_clock::now();
+    if (!write_output(objPath))
+        return false;
+    Emit.record(generated, start);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string fileName;
+    unsigned rounds = 3;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && arg[2] >= '0' && arg[2] <= '3')
+            OptLevel = arg[2] - '0';
+        else if (arg == "-n" && i + 1 < argc)
+            rounds = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else
+            fileName = arg;
+    }
+    if (fileName.empty()) {
+        errs() << "usage: ./frontbench [-O0|-O1|-O2|-O3] [-n ROUNDS] bench.mc\n";
+        return 1;
+    }
+
+    auto BufOrErr = MemoryBuffer::getFile(fileName);
+    if (!BufOrErr) {
+        errs() << "Could not open " << fileName << ": " << BufOrErr.getError().message() << "\n";
+        return 1;
+    }
+    StringRef source = (*BufOrErr)->getBuffer();
+
+    SmallString<128> objPath;
+    if (std::error_code EC = sys::fs::createTemporaryFile("frontbench", "o", objPath)) {
+        errs() << "Could not create temporary file: " << EC.message() << "\n";
+        return 1;
+    }
+
+    InitializeTargets();
+    bool ok = true;
+    for (unsigned i = 0; i < rounds && ok; i++)
+        ok = runRound(source, objPath.str().str());
+    uint64_t objectBytes = 0;
+    sys::fs::file_size(objPath, objectBytes);
+    sys::fs::remove(objPath);
+    if (!ok)
+        return 1;
+
+    json::Object result{
+        {"input", fileName},
+        {"bytes", (int64_t)source.size()},
+        {"opt_level", (int64_t)OptLevel},
+        {"rounds", (int64_t)rounds},
+        {"lex", json::Object{
+            {"tokens", (int64_t)Lex.count},
+            {"seconds", Lex.seconds},
+            {"tokens_per_sec", Lex.rate()}}},
+        {"parse", json::Object{
+            {"nodes", (int64_t)Parse.count},
+            {"seconds", Parse.seconds},
+            {"nodes_per_sec", Parse.rate()}}},
+        {"codegen", json::Object{
+            {"functions", (int64_t)Codegen.count},
+            {"seconds", Codegen.seconds},
+            {"functions_per_sec", Codegen.rate()}}},
+        {"emit", json::Object{
+            {"functions", (int64_t)Emit.count},
+            {"object_bytes", (int64_t)objectBytes},
+            {"seconds", Emit.seconds}}},
+    };
+    outs() << json::Value(std::move(result)) << "\n";
+    return 0;
+}
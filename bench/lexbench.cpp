@@ -0,0 +1,140 @@
+// lexbench - Lexerの読み飛ばし(scan.h)のマイクロベンチマーク
+//
+// インデントが深く長い識別子やコメントが多い、機械生成風のソースをメモリ上に作り、
+// スカラー/SSE2/AVX2の各Scannerで全トークンを読み切る時間を比べる。
+// 各Scannerのトークン列が一致することも確認する。
+//
+//   $ make lexbench
+//   $ ./lexbench [MB]      (デフォルトは64MB)
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#include "../src/diag.h"
+
+#include "../src/symbol.h"
+
+#include "../src/scan.h"
+
+#include "../src/lexer.h"
+
+// generateSource - 約sizeバイトのMCのソースを作る。
+// 生成コードを真似て、深いインデント、長い識別子、説明コメントを多くしている。
+static std::string generateSource(size_t size) {
+    std::string src;
+    src.reserve(size + 1024);
+    std::string indent(24, ' ');
+    unsigned n = 0;
+    while (src.size() < size) {
+        std::string fn = "generated_module_component_serializer_field_accessor_" +
+            std::to_string(n++);
+        std::string a = "first_argument_value_from_generated_schema";
+        std::string b = "second_argument_value_from_generated_schema";
+        src += "# " + fn + " is generated from the schema definition file,"
+            " do not edit this function by hand\n";
+        src += "def int " + fn + "(int " + a + " int " + b + ")\n";
+        src += indent + "if " + a + " < " + b + " then\n";
+        src += indent + indent + fn + "(" + a + " + 1 " + b + ")\n";
+        src += indent + "else\n";
+        src += indent + indent + a + " * 12345 - " + b + ";\n";
+        src += indent + "# trailing comment explaining the arithmetic above in some detail\n\n";
+    }
+    return src;
+}
+
+// scanAll - 空白、コメント、識別子の読み飛ばしだけでsourceを最後まで読む。
+// Lexerの他の部分(キーワードの判定や数値の変換等)を除いた、Scanner自体の速さを測る。
+static uint64_t scanAll(StringRef source, uint64_t &runs) {
+    const char *p = source.data();
+    uint64_t checksum = 0;
+    runs = 0;
+    while (*p) {
+        const char *start = p;
+        if (*p == '#')
+            p = TheScanner->skipLine(p + 1);
+        else if (isAlnumChar(*p))
+            p = TheScanner->skipAlnum(p + 1);
+        else if (isSpaceChar(*p))
+            p = TheScanner->skipSpace(p);
+        else
+            p++;
+        checksum = checksum * 31 + (p - start);
+        runs++;
+    }
+    return checksum;
+}
+
+// lexAll - sourceを最後まで読み、トークン数とチェックサムを返す。
+static uint64_t lexAll(StringRef source, uint64_t &tokens) {
+    Lexer lex;
+    lex.initBuffer(source);
+    uint64_t checksum = 0;
+    tokens = 0;
+    int tok;
+    while ((tok = lex.gettok()) != tok_eof) {
+        checksum = checksum * 31 + (uint64_t)(int64_t)tok;
+        if (tok == tok_identifier)
+            checksum += lex.getIdentifier().size();
+        tokens++;
+    }
+    return checksum;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+    std::string source = generateSource(mb << 20);
+    // Lexerと同じく、末尾の'\0'を番兵にする(c_strの'\0')。
+
+    std::vector<const Scanner *> scanners = {&ScalarScanner};
+#ifdef MC_SCAN_X86
+    scanners.push_back(&SSE2Scanner);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanners.push_back(&AVX2Scanner);
+#endif
+
+    outs() << "input: " << source.size() << " bytes (selected: "
+        << selectScanner()->name << ")\n";
+    // scan: Scannerだけ、lex: Lexer::gettokで全トークンを読む
+    const char *modes[] = {"scan", "lex"};
+    for (int mode = 0; mode < 2; mode++) {
+        double scalarSec = 0;
+        uint64_t expected = 0;
+        for (const Scanner *S : scanners) {
+            TheScanner = S;
+            // 最速の回を取る
+            double best = 1e9;
+            uint64_t count = 0, checksum = 0;
+            for (int i = 0; i < 5; i++) {
+                auto start = std::chrono::steady_clock::now();
+                checksum = mode == 0 ? scanAll(source, count) : lexAll(source, count);
+                std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+                best = std::min(best, d.count());
+            }
+            if (S == &ScalarScanner) {
+                scalarSec = best;
+                expected = checksum;
+            } else if (checksum != expected) {
+                errs() << modes[mode] << "/" << S->name << ": result differs from scalar\n";
+                return 1;
+            }
+            outs() << format("%-4s %-8s %8.2f ms  %8.1f MB/s  %6.2fx  (%llu %s)\n",
+                    modes[mode], S->name, best * 1e3, source.size() / best / (1 << 20),
+                    scalarSec / best, (unsigned long long)count,
+                    mode == 0 ? "runs" : "tokens");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+// ltobench - C++のループからMCの小さな関数を呼ぶベンチマーク
+//
+// test/test_lto.mcの関数を、普通のオブジェクトファイルとしてリンクした場合(./ltobench)と、
+// --emit=thinltoのビットコードをclang++ -flto=thinでリンクした場合(./ltobench-lto)で比べる。
+// ThinLTOでは関数がループの中にインライン展開されるので、呼び出しのコストが無くなる。
+// 二つの結果のchecksumは同じになる。
+//
+//   $ make ltobench
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+extern "C" {
+    double lerp(double a, double b, double t);
+    int64_t clampIndex(int64_t i, int64_t n);
+}
+
+int main() {
+    const int64_t n = 1 << 16;
+    const int rounds = 1000;
+    std::vector<double> xs(n);
+    for (int64_t i = 0; i < n; i++)
+        xs[i] = (double)(i % 100) / 7.0;
+
+    auto start = std::chrono::steady_clock::now();
+    double sum = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int64_t i = 0; i < n; i++)
+            sum += lerp(xs[i], xs[clampIndex(i + 1, n)], 0.25);
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    printf("lerp + clampIndex: %.2f ns/iteration (checksum %.6f)\n",
+            d.count() * 1e9 / ((double)n * rounds), sum);
+    return 0;
+}
@@ -0,0 +1,116 @@
+// mcgen - ベンチマーク用の大きなMCのプログラムを生成する
+//
+// 次の4種類の関数を順番に、合計defs個生成して標準出力に書く。
+//   chainN: 長さchainの二項演算子の連鎖(int)
+//   nestN:  深さdepthのif/then/elseの入れ子(double)
+//   tableN: table個の数値リテラルの表(double)
+//   callN:  それまでのchainNを呼び出す関数(int)
+// 同じ引数からは常に同じプログラムができるので、リリース間で結果を比べられる。
+//
+//   $ ./mcgen [-defs N] [-depth D] [-chain L] [-table T] [-seed S] > bench.mc
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// 線形合同法の乱数。標準ライブラリの実装に依らず同じ列になるようにする。
+static uint64_t Seed = 1;
+static unsigned rnd(unsigned n) {
+    Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(Seed >> 33) % n;
+}
+
+static std::string doubleLiteral() {
+    char buf[32];
+    switch (rnd(3)) {
+        case 0:
+            snprintf(buf, sizeof(buf), "%u.%03u", rnd(1000), rnd(1000));
+            break;
+        case 1:
+            snprintf(buf, sizeof(buf), "%u.%ue%u", 1 + rnd(9), rnd(100), rnd(8));
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "0.%06u", rnd(1000000));
+            break;
+    }
+    return buf;
+}
+
+static void genChain(unsigned n, unsigned length) {
+    static const char *ops[] = {" + ", " - ", " * "};
+    static const char *operands[] = {"a", "b"};
+    printf("def int chain%u(int a, int b)\n    a", n);
+    for (unsigned i = 1; i < length; i++) {
+        fputs(ops[rnd(3)], stdout);
+        if (rnd(3) == 0)
+            printf("%u", 1 + rnd(100));
+        else
+            fputs(operands[rnd(2)], stdout);
+        if (i % 16 == 0)
+            fputs("\n   ", stdout);
+    }
+    fputs("\n\n", stdout);
+}
+
+static void genNest(unsigned n, unsigned depth) {
+    printf("def double nest%u(double x)\n", n);
+    for (unsigned i = 0; i < depth; i++) {
+        std::string indent(4 + i * 2, ' ');
+        printf("%sif x < %u.5 then %s * x else\n", indent.c_str(), i, doubleLiteral().c_str());
+    }
+    printf("%sx * 2.0\n\n", std::string(4 + depth * 2, ' ').c_str());
+}
+
+static void genTable(unsigned n, unsigned size) {
+    printf("def double table%u(double x)\n    x", n);
+    for (unsigned i = 0; i < size; i++) {
+        printf(" %s %s", rnd(2) ? "+" : "-", doubleLiteral().c_str());
+        if (i % 8 == 7)
+            fputs("\n   ", stdout);
+    }
+    fputs("\n\n", stdout);
+}
+
+static void genCall(unsigned n, unsigned numChains) {
+    printf("def int call%u(int a)\n    ", n);
+    for (unsigned i = 0; i < 4; i++) {
+        if (i > 0)
+            fputs(" + ", stdout);
+        printf("chain%u(a, a + %u)", rnd(numChains) * 4, i);
+    }
+    fputs("\n\n", stdout);
+}
+
+int main(int argc, char **argv) {
+    unsigned defs = 2000, depth = 32, chain = 128, table = 256;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        unsigned v = strtoul(argv[i + 1], nullptr, 10);
+        if (!strcmp(argv[i], "-defs"))
+            defs = v;
+        else if (!strcmp(argv[i], "-depth"))
+            depth = v;
+        else if (!strcmp(argv[i], "-chain"))
+            chain = v < 1 ? 1 : v;
+        else if (!strcmp(argv[i], "-table"))
+            table = v;
+        else if (!strcmp(argv[i], "-seed"))
+            Seed = v;
+        else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    printf("# generated by mcgen -defs %u -depth %u -chain %u -table %u\n\n",
+            defs, depth, chain, table);
+    for (unsigned n = 0; n < defs; n++) {
+        switch (n % 4) {
+            case 0: genChain(n, chain); break;
+            case 1: genNest(n, depth); break;
+            case 2: genTable(n, table); break;
+            case 3: genCall(n, n / 4 + 1); break;
+        }
+    }
+    return 0;
+}
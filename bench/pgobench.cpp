@@ -0,0 +1,40 @@
+// pgobench - test/test_pgo.mcのclassifyの分岐を偏った入力で動かすベンチマーク
+//
+// 入力のほとんどは5桁以上の値なので、classifyの最後の枝をよく通る。
+// --instrumentのオブジェクトとリンクして実行するとプロファイルを書き出し(./pgobench-gen)、
+// それを--profile-useで使ったオブジェクトと比べる(./pgobench-use)。二つのchecksumは同じになる。
+//
+//   $ make pgo
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+extern "C" {
+    int64_t countClasses(const int64_t *xs, int64_t n, int64_t c);
+}
+
+int main() {
+    const int64_t n = 1 << 16;
+    const int rounds = 200;
+    std::vector<int64_t> xs(n);
+    uint64_t seed = 12345;
+    for (int64_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint64_t r = seed >> 33;
+        // 1/16だけが4桁以下
+        xs[i] = r % 16 == 0 ? (int64_t)(r % 10000) : 10000 + (int64_t)(r % 1000000);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t sum = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int64_t c = 1; c <= 5; c++)
+            sum += countClasses(xs.data(), n, c) * c;
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    printf("countClasses: %.2f ns/element (checksum %lld)\n",
+            d.count() * 1e9 / ((double)n * rounds * 5), (long long)sum);
+    return 0;
+}
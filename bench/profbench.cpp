@@ -0,0 +1,23 @@
+// profbench - --profile-callsでコンパイルしたtest/test_profile.mcを呼ぶ
+//
+// 途中でmc_profile_dump()を呼んでその時点のカウンタを書き、終了時にもう一度
+// (atexitで)全体のカウンタが標準エラー出力にCSVで書かれる。
+//
+//   $ make profile-calls
+#include <cstdint>
+#include <cstdio>
+
+extern "C" {
+    int64_t fib(int64_t x);
+    int64_t fibMemo(int64_t x);
+    int64_t sumSquares(int64_t n);
+    void mc_profile_dump();
+}
+
+int main() {
+    int64_t sum = fib(25);
+    mc_profile_dump();
+    sum += fibMemo(80) + sumSquares(1000000);
+    printf("checksum %lld\n", (long long)sum);
+    return 0;
+}
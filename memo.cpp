@@ -0,0 +1,23 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+extern "C" {
+    double fib(int64_t x);
+    double fibd(double x);
+}
+
+// 引数を実行時に決めるので、定数評価されずにmemoのラッパーを通る。
+// fibはdense table、fibdはハッシュテーブルを引く。
+int main(int argc, char *argv[]) {
+    int64_t n = argc > 1 ? std::atoll(argv[1]) : 90;
+
+    std::cout << std::setprecision(20);
+    std::cout << "fib(" << n << ") = " << fib(n) << std::endl;
+    std::cout << "fibd(" << n << ".0) = " << fibd((double)n) << std::endl;
+    // 二度目はキャッシュから返る
+    std::cout << "fib(" << n << ") = " << fib(n) << std::endl;
+
+    return 0;
+}
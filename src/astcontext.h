@@ -0,0 +1,94 @@
+//===----------------------------------------------------------------------===//
+// AST Context
+// ASTのノードは全てASTContextのアリーナ(BumpPtrAllocator)に確保する。
+// ノードは一つずつnewしたりdeleteしたりせず、コンパイルが終わった時に
+// アリーナごとまとめて解放する。ノードが連続したメモリに並ぶので、
+// codegen等でASTを辿る時のキャッシュの効率も良くなる。
+//
+// 個別にデストラクタを呼ばないので、アリーナに置く型はtrivially destructible
+// (std::stringやstd::vector等を持たない)でなければならない。文字列はSymbol、
+// 配列はASTContextに確保したArrayRefで持つ。
+//===----------------------------------------------------------------------===//
+
+// ASTNodeKind - ASTのノードの種類。--statsで種類毎のノードの数を数えるのに使う。
+// ASTContextに置く型はKindにどれかを持つ。
+enum ASTNodeKind {
+    NODE_NUMBER,
+    NODE_VARIABLE,
+    NODE_BINARY,
+    NODE_NOT,
+    NODE_CALL,
+    NODE_IF,
+    NODE_FOR,
+    NODE_INDEX,
+    NODE_BUILTIN,
+    NODE_LET,
+    NODE_ASSIGN,
+    NODE_SEQ,
+    NODE_PROTOTYPE,
+    NODE_FUNCTION,
+    NUM_NODE_KINDS
+};
+static const char *const ASTNodeKindNames[NUM_NODE_KINDS] = {
+    "number", "variable", "binary", "not", "call", "if", "for", "index", "builtin",
+    "let", "assign", "seq", "prototype", "function"
+};
+
+class ASTContext {
+    public:
+        // create - Tをアリーナに作る。
+        template <typename T, typename... Args>
+        T *create(Args &&... args) {
+            static_assert(std::is_trivially_destructible<T>::value,
+                    "AST nodes are freed in bulk and must be trivially destructible");
+            numNodes++;
+            numNodesByKind[T::Kind]++;
+            void *mem = allocator.Allocate(sizeof(T), alignof(T));
+            return new (mem) T(std::forward<Args>(args)...);
+        }
+
+        // copyArray - 配列の中身をアリーナにコピーする。
+        template <typename T>
+        MutableArrayRef<T> copyArray(ArrayRef<T> array) {
+            static_assert(std::is_trivially_destructible<T>::value,
+                    "arena arrays are freed in bulk and must be trivially destructible");
+            if (array.empty())
+                return MutableArrayRef<T>();
+            numArrays++;
+            T *mem = allocator.Allocate<T>(array.size());
+            std::uninitialized_copy(array.begin(), array.end(), mem);
+            return MutableArrayRef<T>(mem, array.size());
+        }
+
+        uint64_t getNumNodes() const { return numNodes; }
+        uint64_t getNumNodes(ASTNodeKind kind) const { return numNodesByKind[kind]; }
+        uint64_t getBytesAllocated() const { return allocator.getBytesAllocated(); }
+
+        // printStats - アリーナの使用状況を表示する(--stats)。
+        // mallocとfreeはスラブ単位でしか起きない。表示するのは今持っているスラブの数で、
+        // これらはreset(複数ファイルの場合はジョブ毎)か終了時にまとめて解放する。
+        void printStats(raw_ostream &OS) const {
+            OS << "AST arena:\n";
+            OS << "  nodes allocated:   " << numNodes << "\n";
+            OS << "  arrays allocated:  " << numArrays << "\n";
+            OS << "  bytes allocated:   " << allocator.getBytesAllocated() << "\n";
+            OS << "  arena memory:      " << allocator.getTotalMemory() << "\n";
+            OS << "  slabs held:        " << allocator.GetNumSlabs() << "\n";
+        }
+
+        // reset - 全てのノードをまとめて解放する。それまでのポインタは使えなくなる。
+        void reset() {
+            allocator.Reset();
+            numNodes = 0;
+            numArrays = 0;
+            std::fill(std::begin(numNodesByKind), std::end(numNodesByKind), 0);
+        }
+
+    private:
+        BumpPtrAllocator allocator;
+        uint64_t numNodes = 0;
+        uint64_t numArrays = 0;
+        uint64_t numNodesByKind[NUM_NODE_KINDS] = {};
+};
+
+static thread_local ASTContext ASTCtx;
@@ -0,0 +1,299 @@
+//===----------------------------------------------------------------------===//
+// Object cache
+// --cache-dir=DIR(--cacheなら~/.cache/mc)を指定すると、defとtop level expression
+// 毎に別々のModuleにcodegenし、それぞれを最適化したオブジェクトコードをDIRに
+// キャッシュする。次回からは変更の無い関数は最適化もコード生成もせずに
+// キャッシュのオブジェクトを使い、最後に`ld -r`で一つのoutput.oにまとめる。
+//
+// キャッシュのキーは以下をまとめたSHA1で、ファイル名は"<キー>.o"になる。
+// - 定数畳み込みをした後の関数のAST(引数は名前ではなく何番目の引数かで正規化する)
+// - 呼び出している関数のシグネチャ
+// - ターゲット(triple, CPU, features)、最適化レベル、--multiversion、--profile-calls、
+//   LLVMのバージョン等
+// 関数毎に最適化するので、関数をまたいだインライン展開はされない。
+//===----------------------------------------------------------------------===//
+
+// キャッシュの形式を変えた場合はこれを変えて古いキャッシュを使わないようにする。
+static const char *CacheFormatVersion = "mc-object-cache-3";
+
+// ASTHasher - 関数のASTを正規化してハッシュする。
+class ASTHasher {
+    public:
+        // ASTの各ノードの種類
+        enum NodeTag {
+            TAG_NUMBER = 1,
+            TAG_VARIABLE,
+            TAG_BINARY,
+            TAG_CALL,
+            TAG_IF,
+            TAG_FOR,
+            TAG_INDEX,
+            TAG_BUILTIN,
+            TAG_LET,
+            TAG_ASSIGN,
+            TAG_SEQ,
+            TAG_NOT
+        };
+
+        ASTHasher(ArrayRef<ArgTuple> params) : params(params) {}
+
+        void add(uint64_t value) {
+            uint8_t bytes[8];
+            for (int i = 0; i < 8; i++)
+                bytes[i] = (uint8_t)(value >> (i * 8));
+            hasher.update(ArrayRef<uint8_t>(bytes));
+        }
+        void add(StringRef str) {
+            add(str.size());
+            hasher.update(str);
+        }
+
+        // addVariable - 変数の名前はオブジェクトコードに影響しないので、何番目の引数か
+        // (ループ変数やletの変数なら、引数の後に外側から何番目の変数か)を加える。
+        void addVariable(Symbol name) {
+            for (size_t i = locals.size(); i-- > 0;) {
+                if (locals[i] == name) {
+                    add(params.size() + i);
+                    return;
+                }
+            }
+            for (size_t i = 0; i < params.size(); i++) {
+                if (params[i].name == name) {
+                    add(i);
+                    return;
+                }
+            }
+            add(~0ull);
+        }
+
+        // addPrototype - 関数の名前、返り値と引数の型、アノテーション(-ffp-modeで決まる
+        // 浮動小数点数の演算のモードを含む)を加える。
+        void addPrototype(const PrototypeAST &proto) {
+            add(proto.getFunctionName());
+            add((uint64_t)proto.getType());
+            add(proto.getArgs().size());
+            for (const ArgTuple &arg : proto.getArgs())
+                add((uint64_t)arg.type);
+            add(proto.hasAttribute(ATTR_TAILREC));
+            add(proto.hasAttribute(ATTR_MEMO));
+            add((uint64_t)proto.getFPMode());
+        }
+
+        void pushLocal(Symbol name) { locals.push_back(name); }
+        void popLocal() { locals.pop_back(); }
+
+        std::string result() { return toHex(hasher.final(), true); }
+
+    private:
+        SHA1 hasher;
+        ArrayRef<ArgTuple> params;
+        SmallVector<Symbol, 4> locals;
+};
+
+void NumberAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_NUMBER);
+    H.add((uint64_t)type);
+    if (type == INT || type == BOOL) {
+        H.add((uint64_t)intVal);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &doubleVal, sizeof(bits));
+        H.add(bits);
+    }
+}
+
+void NotExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_NOT);
+    Operand->hash(H);
+}
+
+void VariableExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_VARIABLE);
+    H.addVariable(variableName);
+}
+
+void BinaryAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_BINARY);
+    H.add((uint64_t)Op);
+    LHS->hash(H);
+    RHS->hash(H);
+}
+
+void CallExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_CALL);
+    H.addPrototype(*calleeProto);
+    for (ExprAST *arg : ArgList)
+        arg->hash(H);
+}
+
+void IfExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_IF);
+    Cond->hash(H);
+    Then->hash(H);
+    Else->hash(H);
+}
+
+void ForExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_FOR);
+    H.add(vectorize);
+    H.add(unrollCount);
+    Start->hash(H);
+    End->hash(H);
+    H.add(Step != nullptr);
+    if (Step)
+        Step->hash(H);
+    H.pushLocal(varName);
+    Body->hash(H);
+    H.popLocal();
+}
+
+void IndexExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_INDEX);
+    H.addVariable(arrayName);
+    Index->hash(H);
+    H.add(StoreValue != nullptr);
+    if (StoreValue)
+        StoreValue->hash(H);
+}
+
+void BuiltinCallAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_BUILTIN);
+    H.add((uint64_t)builtin);
+    H.add(ArgList.size());
+    for (ExprAST *arg : ArgList)
+        arg->hash(H);
+}
+
+void LetExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_LET);
+    H.add(isMutable);
+    H.add(bindings.size());
+    for (const LetBinding &binding : bindings) {
+        binding.init->hash(H);
+        H.pushLocal(binding.name);
+    }
+    Body->hash(H);
+    for (size_t i = 0; i < bindings.size(); i++)
+        H.popLocal();
+}
+
+void AssignExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_ASSIGN);
+    H.addVariable(varName);
+    StoreValue->hash(H);
+}
+
+void SeqExprAST::hash(ASTHasher &H) {
+    H.add(ASTHasher::TAG_SEQ);
+    H.add(Exprs.size());
+    for (ExprAST *E : Exprs)
+        E->hash(H);
+}
+
+// getCacheConfig - キャッシュのキーに含める、関数以外の設定
+static std::string computeCacheConfig() {
+    std::string config, CPU, Features;
+    getTargetCPUAndFeatures(CPU, Features);
+    raw_string_ostream OS(config);
+    OS << CacheFormatVersion << ";" << LLVM_VERSION_STRING << ";"
+        << sys::getDefaultTargetTriple() << ";" << CPU << ";" << Features
+        << ";O" << OptLevel << ";" << (MultiVersion ? "multiversion" : "")
+        << ";" << (InternalTopLevelExprs ? "internal-top-level" : "")
+        << ";" << (ProfileCalls ? "profile-calls" : "");
+    return OS.str();
+}
+static const std::string &getCacheConfig() {
+    // 全てのスレッドで共通なので一度だけ作る。
+    static const std::string config = computeCacheConfig();
+    return config;
+}
+
+// CacheUnit - キャッシュする一つの単位(一つのdefかtop level expression)
+struct CacheUnit {
+    std::string key;
+    std::unique_ptr<Module> module;
+};
+static thread_local std::vector<CacheUnit> CacheUnits;
+
+// AddModuleToCache - 今codegenした関数のModuleをキーと一緒に取っておき、
+// 次の関数用に新しいModuleを作る。
+static void AddModuleToCache(FunctionAST &FnAST) {
+    TimePhase T(CacheKeyTimer);
+    const PrototypeAST &proto = FnAST.getProto();
+    ASTHasher H(proto.getArgs());
+    H.add(getCacheConfig());
+    H.addPrototype(proto);
+    FnAST.getBody().hash(H);
+
+    CacheUnit unit;
+    unit.key = H.result();
+    unit.module = std::move(myModule);
+    CacheUnits.push_back(std::move(unit));
+    InitializeModule();
+}
+
+// storeCacheObject - オブジェクトをpathに保存する。他のプロセスが同時に同じキーを
+// 書いても壊れないよう、一時ファイルに書いてからrenameする。
+static void storeCacheObject(const std::string &path, ArrayRef<char> object) {
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(path + ".tmp-%%%%%%", FD, TempPath))
+        return;
+    {
+        raw_fd_ostream OS(FD, true);
+        OS.write(object.data(), object.size());
+    }
+    if (sys::fs::rename(TempPath, path))
+        sys::fs::remove(TempPath);
+}
+
+static bool writeObjectCached(const Target *T, const std::string &TargetTriple,
+        const std::string &Filename) {
+    if (MultiVersion && !checkMultiversionTarget(Triple(TargetTriple)))
+        return false;
+    if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+        diags() << "Could not create cache directory " << CacheDir << ": " << EC.message() << "\n";
+        return false;
+    }
+
+    // 関数が一つも無い場合も、空のoutput.oを作るために空のModuleをコンパイルする。
+    if (CacheUnits.empty()) {
+        CacheUnit unit;
+        unit.module = std::move(myModule);
+        CacheUnits.push_back(std::move(unit));
+    }
+
+    std::unique_ptr<TargetMachine> TM(createTargetMachine(T, TargetTriple));
+    std::vector<Partition> partitions(CacheUnits.size());
+    std::vector<Partition *> misses;
+    std::vector<std::string> paths(CacheUnits.size());
+    for (size_t i = 0; i < CacheUnits.size(); i++) {
+        CacheUnit &unit = CacheUnits[i];
+        Partition &P = partitions[i];
+        if (!unit.key.empty()) {
+            SmallString<128> path(CacheDir);
+            sys::path::append(path, unit.key + ".o");
+            paths[i] = path.str().str();
+            if (auto Buf = MemoryBuffer::getFile(paths[i])) {
+                P.object.append((*Buf)->getBufferStart(), (*Buf)->getBufferEnd());
+                Stats.cacheHits++;
+                continue;
+            }
+            Stats.cacheMisses++;
+        }
+
+        unit.module->setTargetTriple(TargetTriple);
+        unit.module->setDataLayout(TM->createDataLayout());
+        raw_svector_ostream OS(P.bitcode);
+        WriteBitcodeToFile(*unit.module, OS);
+        misses.push_back(&P);
+    }
+
+    if (!compilePartitions(T, TargetTriple, misses))
+        return false;
+    for (size_t i = 0; i < CacheUnits.size(); i++) {
+        if (!paths[i].empty() && !partitions[i].bitcode.empty())
+            storeCacheObject(paths[i], partitions[i].object);
+    }
+    return linkObjects(partitions, Filename);
+}
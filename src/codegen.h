@@ -4,23 +4,43 @@
 // といっても、難しいことをしているわけではなく、IRBuilder(https://llvm.org/doxygen/IRBuilder_8h_source.html)
 // のインターフェースを利用して、parser.hで定義した「ソースコードの意味」をIRに落としています。
 // 各ファイルの中で一番LLVMの機能を多用しているファイルです。
+//
+// 複数のファイルを別々のスレッドで同時にコンパイルできるよう、コンパイル毎の状態
+// (Context, Builder, myModule等)はthread_localにしている。
 //===----------------------------------------------------------------------===//
 
 // https://llvm.org/doxygen/LLVMContext_8h_source.html
-static LLVMContext Context;
+// JITにModuleを渡せるよう、ContextはThreadSafeContextに所有させている。
+static thread_local orc::ThreadSafeContext TSContext(llvm::make_unique<LLVMContext>());
+static thread_local LLVMContext &Context = *TSContext.getContext();
 // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html
 // LLVM IRを生成するためのインターフェース
-static IRBuilder<> Builder(Context);
+static thread_local IRBuilder<> Builder(Context);
 // https://llvm.org/doxygen/classllvm_1_1Module.html
 // このModuleはC++ Moduleとは何の関係もなく、LLVM IRを格納するトップレベルオブジェクトです。
-static std::unique_ptr<Module> myModule;
+static thread_local std::unique_ptr<Module> myModule;
 
 struct VariableTuple {
+    // varの変数の場合は、値を置いたallocaを指す。
     Value *value;
     NumType type;
+    // 配列の場合、valueは先頭のポインタで、lengthが長さ。それ以外はnullptr。
+    Value *length;
 };
-// 変数名とllvm::Valueのマップを保持する
-static std::map<std::string, VariableTuple> NamedValues;
+// 変数名(Symbol)とllvm::Valueのマップを保持する
+// 関数の引数、ループ変数、letの変数はそれぞれVarScopeを作ってから登録するので、
+// スコープを抜けると登録した変数は消え、外側の同じ名前の変数が見えるようになる。
+static thread_local ScopedHashTable<Symbol, VariableTuple> NamedValues;
+typedef ScopedHashTableScope<Symbol, VariableTuple> VarScope;
+
+// TailRecLoop - 末尾再帰をループに変換している関数のループの情報。
+// 自分自身への末尾呼び出しは、新しい引数をargsのphiに渡してheaderに飛ぶ分岐になる。
+struct TailRecLoop {
+    BasicBlock *header;
+    std::vector<PHINode *> args;
+};
+// 今codegenしている関数が末尾再帰を含む場合にそのループを指す。含まない場合はnullptr。
+static thread_local TailRecLoop *CurTailRec = nullptr;
 
 Type *cvtNumTypeToType(NumType nt) {
     Type *t;
@@ -28,6 +48,13 @@ Type *cvtNumTypeToType(NumType nt) {
         t = Type::getInt64Ty(Context);
     } else if (nt == DOUBLE) {
         t = Type::getDoubleTy(Context);
+    } else if (nt == BOOL) {
+        t = Type::getInt1Ty(Context);
+    } else if (isArrayType(nt)) {
+        // 配列の値は先頭の要素へのポインタ
+        t = PointerType::getUnqual(cvtNumTypeToType(getElementType(nt)));
+    } else if (isVectorType(nt)) {
+        t = VectorType::get(cvtNumTypeToType(getScalarType(nt)), getVectorWidth(nt));
     } else {
         LogError("type not found");
         t = nullptr;
@@ -41,6 +68,8 @@ NumType cvtTypeToNumType(Type *t) {
         nt = INT;
     } else if (t == Type::getDoubleTy(Context)) {
         nt = DOUBLE;
+    } else if (t == Type::getInt1Ty(Context)) {
+        nt = BOOL;
     } else {
         LogError("typenum not found");
         nt = DEFAULT;
@@ -55,6 +84,8 @@ Value *NumberAST::codegen() {
     // 64bit整数型のValueを返す
     if (type == INT) {
         return ConstantInt::get(Context, APInt(64, intVal, true));
+    } else if (type == BOOL) {
+        return ConstantInt::get(Type::getInt1Ty(Context), intVal);
     } else {
         return ConstantFP::get(Context, APFloat(doubleVal));
     }
@@ -70,152 +101,309 @@ Function *LogErrorF(const char *str) {
     return nullptr;
 }
 
+// getFunction - 関数名からllvm::Functionを得る。現在のModuleに無ければ、
+// FunctionProtos(sema.h)に登録されたシグネチャから宣言を作る。JITではModule毎に
+// コンパイルするので、以前のModuleで定義された関数を呼ぶ時はここで宣言を作り直す。
+Function *getFunction(Symbol Name) {
+    if (Function *F = myModule->getFunction(Symbols.getName(Name)))
+        return F;
+
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    return nullptr;
+}
+
 // TODO 2.4: 引数のcodegenを実装してみよう
 Value *VariableExprAST::codegen() {
     // NamedValuesの中にVariableExprAST::NameとマッチするValueがあるかチェックし、
-    // あったらそのValueを返す。
-    if (NamedValues.count(variableName) > 0) {
-        VariableTuple vt = NamedValues[variableName];
-        return vt.value;
-    } else {
+    // あったらそのValueを返す。varの変数ならallocaから読む。
+    if (!NamedValues.count(variableName))
         return LogErrorV("Unknown variable name");
+    Value *V = NamedValues.lookup(variableName).value;
+    if (auto *Alloca = dyn_cast<AllocaInst>(V))
+        return Builder.CreateLoad(Alloca->getAllocatedType(), Alloca, Alloca->getName());
+    return V;
+}
+
+Value *VariableExprAST::codegenLength() {
+    Value *Length = NamedValues.lookup(variableName).length;
+    if (!Length)
+        return LogErrorV("Unknown array name");
+    return Length;
+}
+
+// IndexExprAST::codegen - 要素のアドレスをGEPで計算し、loadかstoreをする。
+// 範囲のチェックはしないので、範囲外の添字の動作は未定義になる(C++の配列と同じ)。
+Value *IndexExprAST::codegen() {
+    if (!NamedValues.count(arrayName))
+        return LogErrorV("Unknown variable name");
+    Value *Array = NamedValues.lookup(arrayName).value;
+    Value *IndexV = Index->codegen();
+    if (!IndexV)
+        return nullptr;
+
+    Type *ElemTy = cvtNumTypeToType(type);
+    Value *Ptr = Builder.CreateInBoundsGEP(ElemTy, Array, IndexV, "elem_ptr");
+    if (!StoreValue)
+        return Builder.CreateLoad(ElemTy, Ptr, "elem");
+
+    Value *V = StoreValue->codegen();
+    if (!V)
+        return nullptr;
+    Builder.CreateStore(V, Ptr);
+    return V;
+}
+
+// getShuffleMask - shufflevectorのマスク(<N x i32>の定数)
+static Constant *getShuffleMask(ArrayRef<uint32_t> indices) {
+    return ConstantDataVector::get(Context, indices);
+}
+
+// emitReduce - ベクトルVの要素をopでまとめた値。
+// 前半と後半を要素毎に計算することを繰り返す木の形で計算するので、要素数がNなら
+// log2(N)回の演算になる(doubleの和や積は前から順に足した場合と丸めが異なり得る)。
+static Value *emitReduce(Builtin op, Value *V, NumType vecType) {
+    bool isDouble = getScalarType(vecType) == DOUBLE;
+    for (unsigned width = getVectorWidth(vecType); width > 1; width /= 2) {
+        SmallVector<uint32_t, 8> lo, hi;
+        for (unsigned i = 0; i < width / 2; i++) {
+            lo.push_back(i);
+            hi.push_back(width / 2 + i);
+        }
+        Value *Undef = UndefValue::get(V->getType());
+        Value *L = Builder.CreateShuffleVector(V, Undef, getShuffleMask(lo), "reduce_lo");
+        Value *R = Builder.CreateShuffleVector(V, Undef, getShuffleMask(hi), "reduce_hi");
+        switch (op) {
+            case BUILTIN_HADD:
+                V = isDouble ? Builder.CreateFAdd(L, R, "reduce") : Builder.CreateAdd(L, R, "reduce");
+                break;
+            case BUILTIN_HMUL:
+                V = isDouble ? Builder.CreateFMul(L, R, "reduce") : Builder.CreateMul(L, R, "reduce");
+                break;
+            case BUILTIN_HMIN:
+                // intは比較演算子の'<'や'>'と同じくunsignedで比べる。
+                // (hmin(v)がselect(a < b, a, b)を繰り返したのと同じ結果になる)
+                V = Builder.CreateSelect(isDouble ? Builder.CreateFCmpOLT(L, R) :
+                        Builder.CreateICmpULT(L, R), L, R, "reduce");
+                break;
+            default:
+                V = Builder.CreateSelect(isDouble ? Builder.CreateFCmpOGT(L, R) :
+                        Builder.CreateICmpUGT(L, R), L, R, "reduce");
+                break;
+        }
     }
+    return Builder.CreateExtractElement(V, (uint64_t)0, "reduce_result");
 }
 
-NumType VariableExprAST::checkType() {
-    if (NamedValues.count(variableName) > 0) {
-        VariableTuple vt = NamedValues[variableName];
-        return vt.type;
-    } else {
-        LogError("Unknown variable name");
-        return DEFAULT;
+Value *BuiltinCallAST::codegen() {
+    // 配列の型を持つexpressionはVariableExprASTだけ(sema.hのcheckScalar)。
+    if (builtin == BUILTIN_LEN)
+        return static_cast<VariableExprAST *>(ArgList[0])->codegenLength();
+
+    // 要素数やshuffleの添字はリテラルなので、codegenせずに値を使う。
+    auto getCount = [](ExprAST *E) {
+        return (uint32_t)static_cast<NumberAST *>(E)->getIntValue();
+    };
+    size_t numValues = ArgList.size();
+    if (builtin == BUILTIN_BROADCAST || builtin == BUILTIN_LOAD)
+        numValues--;
+    else if (builtin == BUILTIN_SHUFFLE)
+        numValues = 2;
+    SmallVector<Value *, 4> args;
+    for (size_t i = 0; i < numValues; i++) {
+        args.push_back(ArgList[i]->codegen());
+        if (!args.back())
+            return nullptr;
+    }
+
+    switch (builtin) {
+        case BUILTIN_BROADCAST:
+            return Builder.CreateVectorSplat(getVectorWidth(type), args[0], "broadcast");
+        case BUILTIN_SHUFFLE: {
+            SmallVector<uint32_t, 8> indices;
+            for (size_t i = 2; i < ArgList.size(); i++)
+                indices.push_back(getCount(ArgList[i]));
+            return Builder.CreateShuffleVector(args[0], args[1], getShuffleMask(indices),
+                    "shuffle");
+        }
+        case BUILTIN_SELECT: {
+            // ベクトルのマスクは各要素を0と比べてi1にする。比較の結果のマスクなら、
+            // バックエンドはこれをそのままblend命令にする。スカラーのマスクはboolなのでそのまま使う。
+            Value *Cond = args[0];
+            if (isVectorType(ArgList[0]->type))
+                Cond = Builder.CreateICmpNE(args[0],
+                        Constant::getNullValue(args[0]->getType()), "select_mask");
+            return Builder.CreateSelect(Cond, args[1], args[2], "select");
+        }
+        case BUILTIN_HADD:
+        case BUILTIN_HMUL:
+        case BUILTIN_HMIN:
+        case BUILTIN_HMAX:
+            return emitReduce(builtin, args[0], ArgList[0]->type);
+        case BUILTIN_LOAD:
+        case BUILTIN_STORE: {
+            // 配列の要素の大きさ(8)にしかアラインされていないので、alignを明示する。
+            // (指定しないとベクトルの大きさにアラインされているとみなされる。)
+            Type *VecTy = cvtNumTypeToType(type);
+            Type *ElemTy = cvtNumTypeToType(getScalarType(type));
+            Value *Ptr = Builder.CreateInBoundsGEP(ElemTy, args[0], args[1], "elem_ptr");
+            Ptr = Builder.CreateBitCast(Ptr, VecTy->getPointerTo(), "vector_ptr");
+            if (builtin == BUILTIN_LOAD)
+                return Builder.CreateAlignedLoad(VecTy, Ptr, 8, "vector");
+            Builder.CreateAlignedStore(args[2], Ptr, 8);
+            return args[2];
+        }
+        default:
+            return LogErrorV("unknown builtin");
     }
 }
 
 // TODO 2.5: 関数呼び出しのcodegenを実装してみよう
 Value *CallExprAST::codegen() {
-    // 1. myModule->getFunctionを用いてcalleeがdefineされているかを
-    // チェックし、されていればそのポインタを得る。
-    Function *CalleeF = myModule->getFunction(callee);
+    // 1. getFunctionを用いてcalleeのllvm::Functionを得る。
+    // calleeが定義されているか、引数の数と型が合っているかはanalyzeで確認済み。
+    Function *CalleeF = getFunction(callee);
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
-    int i = 0;
     std::vector<Value *> argsV;
     // 3. argsをそれぞれcodegenしllvm::Valueにし、argsVにpush_backする。
-    for (auto &arg : CalleeF->args()) {
-        Value *argV = ArgList[i]->codegen();
-
-        NumType defType = cvtTypeToNumType(arg.getType()); //関数で定義されている型
-        NumType argType = ArgList[i]->checkType(); //実際に呼び出しで指定された値の型
-        if (defType != argType) {
-            //型が一致しない場合
-            return LogErrorV("cannot assign the value to this function");
-        }
-
-        argsV.push_back(argV);
+    for (ExprAST *arg : ArgList) {
+        argsV.push_back(arg->codegen());
         if (!argsV.back())
             return nullptr;
-        i++;
+        // 配列はポインタと長さの二つの引数で渡す。
+        if (isArrayType(arg->type)) {
+            argsV.push_back(static_cast<VariableExprAST *>(arg)->codegenLength());
+            if (!argsV.back())
+                return nullptr;
+        }
+    }
+
+    // 自分自身への末尾呼び出しは、引数を更新してループの先頭に戻る分岐にする。
+    // 関数の返り値はこの後の実行で決まるので、ここで返す値は使われない。
+    if (isSelfTailCall && CurTailRec) {
+        BasicBlock *CurBB = Builder.GetInsertBlock();
+        for (unsigned j = 0; j < argsV.size(); j++)
+            CurTailRec->args[j]->addIncoming(argsV[j], CurBB);
+        Builder.CreateBr(CurTailRec->header);
+        return UndefValue::get(CalleeF->getReturnType());
     }
 
     // 4. IRBuilderのCreateCallを呼び出し、Valueをreturnする。
     return Builder.CreateCall(CalleeF, argsV, "calltmp");
 }
 
-NumType CallExprAST::checkType() {
-    Function *CalleeF = myModule->getFunction(callee);
-    if (!CalleeF) {
-        LogError("Unknown function referenced");
-        return DEFAULT;
-    }
-    Type *retType = CalleeF->getReturnType();
-    return cvtTypeToNumType(retType);
+// compareResult - 比較の結果(i1)をexpressionの型typeの値にする。
+// スカラーの比較はboolなのでi1のまま使う。ベクトルの比較は要素毎に-1か0のintのベクトル
+// (マスク)になる。
+static Value *compareResult(Value *Cmp, NumType type) {
+    if (isVectorType(type))
+        return Builder.CreateSExt(Cmp, cvtNumTypeToType(type), "mask");
+    return Cmp;
 }
 
 Value *BinaryAST::codegen() {
-    // 二項演算子の両方の引数をllvm::Valueにする。
-    NumType type = checkType();
+    // &&と||は、左辺で結果が決まれば右辺を計算しないよう分岐にする。
+    // 値は、左辺だけで決まった場合はその値、そうでなければ右辺の値を選ぶphi。
+    if (isLogical(Op)) {
+        bool isAnd = Op == BinOp::And;
+        Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+        BasicBlock *RHSBB = BasicBlock::Create(Context, isAnd ? "and_rhs" : "or_rhs");
+        BasicBlock *MergeBB = BasicBlock::Create(Context, isAnd ? "and_end" : "or_end");
+        if (!(isAnd ? LHS->codegenCondBr(RHSBB, MergeBB) : LHS->codegenCondBr(MergeBB, RHSBB)))
+            return nullptr;
+        // 左辺の条件が複数のブロックから分岐していても、MergeBBに来る値は全てisAndの否定。
+        SmallVector<BasicBlock *, 4> ShortCircuitBBs(pred_begin(MergeBB), pred_end(MergeBB));
 
-    NumType typeL = LHS->checkType();
-    Value *L = LHS->codegen();
+        ParentFunc->getBasicBlockList().push_back(RHSBB);
+        Builder.SetInsertPoint(RHSBB);
+        Value *R = RHS->codegen();
+        if (!R)
+            return nullptr;
+        Builder.CreateBr(MergeBB);
+        RHSBB = Builder.GetInsertBlock();
+
+        ParentFunc->getBasicBlockList().push_back(MergeBB);
+        Builder.SetInsertPoint(MergeBB);
+        PHINode *PN = Builder.CreatePHI(Builder.getInt1Ty(), ShortCircuitBBs.size() + 1,
+                isAnd ? "and" : "or");
+        for (BasicBlock *BB : ShortCircuitBBs)
+            PN->addIncoming(Builder.getInt1(!isAnd), BB);
+        PN->addIncoming(R, RHSBB);
+        return PN;
+    }
 
-    NumType typeR = RHS->checkType();
+    // 二項演算子の両方の引数をllvm::Valueにする。
+    // 左右の型が同じであることはanalyzeで確認済み。
+    Value *L = LHS->codegen();
     Value *R = RHS->codegen();
 
     if (!L || !R)
         return nullptr;
-    
-    //左右がIntとDoubleで食い違っている場合、Int側にDoubleへのキャストを施す
-    //その予定だったけど、キャストがこれじゃダメらしいから断念。
-    if (typeL == INT && type == DOUBLE) {
-        return LogErrorV("cannot operate between 'int' and 'double'");
-        // L = Builder.CreateFPCast(L, Type::getDoubleTy(Context), "cast_int_to_double");
-    }
-    if (typeR == INT && type == DOUBLE) {
-        return LogErrorV("cannot operate between 'double' and 'int'");
-        // R = Builder.CreateFPCast(R, Type::getDoubleTy(Context), "cast_int_to_double");
-    }
-
-    if (type == DOUBLE) {
-        if (Op == "+") {
-            return Builder.CreateFAdd(L, R, "double_add");
-        } else if (Op == "-") {
-            return Builder.CreateFSub(L, R, "double_sub");
-        } else if (Op == "*") {
-            return Builder.CreateFMul(L, R, "double_mul");
-        } else if (Op == "/") {
-            return Builder.CreateFDiv(L, R, "double_div");
-        } else if (Op == "<") {
-            L = Builder.CreateFCmpULT(L, R, "double_less_than");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else if (Op == ">") {
-            L = Builder.CreateFCmpUGT(L, R, "double_greater_than");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else if (Op == "<=") {
-            L = Builder.CreateFCmpULE(L, R, "double_equal_or_less_than");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else if (Op == ">=") {
-            L = Builder.CreateFCmpUGE(L, R, "double_equal_or_greater_than");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else if (Op == "==") {
-            L = Builder.CreateFCmpUEQ(L, R, "double_equal");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else if (Op == "!=") {
-            L = Builder.CreateFCmpUNE(L, R, "double_not_equal");
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(Context), "bool_to_double");
-        } else {
-            return LogErrorV("invalid binary operator");
+
+    // ベクトルの場合も、IRBuilderの同じ命令が要素毎の演算になる。
+    NumType elemType = getScalarType(LHS->type);
+    if (elemType == DOUBLE) {
+        switch (Op) {
+            case BinOp::Add:
+                return Builder.CreateFAdd(L, R, "double_add");
+            case BinOp::Sub:
+                return Builder.CreateFSub(L, R, "double_sub");
+            case BinOp::Mul:
+                return Builder.CreateFMul(L, R, "double_mul");
+            case BinOp::Div:
+                return Builder.CreateFDiv(L, R, "double_div");
+            case BinOp::LT:
+                return compareResult(Builder.CreateFCmpULT(L, R, "double_less_than"), type);
+            case BinOp::GT:
+                return compareResult(Builder.CreateFCmpUGT(L, R, "double_greater_than"), type);
+            case BinOp::LE:
+                return compareResult(Builder.CreateFCmpULE(L, R, "double_equal_or_less_than"), type);
+            case BinOp::GE:
+                return compareResult(Builder.CreateFCmpUGE(L, R, "double_equal_or_greater_than"), type);
+            case BinOp::EQ:
+                return compareResult(Builder.CreateFCmpUEQ(L, R, "double_equal"), type);
+            case BinOp::NE:
+                return compareResult(Builder.CreateFCmpUNE(L, R, "double_not_equal"), type);
+            default:
+                return LogErrorV("invalid binary operator");
         }
-    } else if (type == INT) {
-        if (Op == "+") {
-            return Builder.CreateAdd(L, R, "int_add");
-        } else if (Op == "-") {
-            return Builder.CreateSub(L, R, "int_sub");
-        } else if (Op == "*") {
-            return Builder.CreateMul(L, R, "int_mul");
-        } else if (Op == "/") {
-            return Builder.CreateSDiv(L, R, "int_div");
-        } else if (Op == "<") {
-            L = Builder.CreateICmpULT(L, R, "int_less_than");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else if (Op == ">") {
-            L = Builder.CreateICmpUGT(L, R, "int_greater_than");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else if (Op == "<=") {
-            L = Builder.CreateICmpULE(L, R, "int_equal_or_less_than");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else if (Op == ">=") {
-            L = Builder.CreateICmpUGE(L, R, "int_equal_or_greater_than");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else if (Op == "==") {
-            L = Builder.CreateICmpEQ(L, R, "int_equal");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else if (Op == "!=") {
-            L = Builder.CreateICmpNE(L, R, "int_not_equal");
-            return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true,  "bool_to_int");
-        } else {
-            return LogErrorV("invalid binary operator");
+    } else if (elemType == INT) {
+        switch (Op) {
+            case BinOp::Add:
+                return Builder.CreateAdd(L, R, "int_add");
+            case BinOp::Sub:
+                return Builder.CreateSub(L, R, "int_sub");
+            case BinOp::Mul:
+                return Builder.CreateMul(L, R, "int_mul");
+            case BinOp::Div:
+                return Builder.CreateSDiv(L, R, "int_div");
+            case BinOp::LT:
+                return compareResult(Builder.CreateICmpULT(L, R, "int_less_than"), type);
+            case BinOp::GT:
+                return compareResult(Builder.CreateICmpUGT(L, R, "int_greater_than"), type);
+            case BinOp::LE:
+                return compareResult(Builder.CreateICmpULE(L, R, "int_equal_or_less_than"), type);
+            case BinOp::GE:
+                return compareResult(Builder.CreateICmpUGE(L, R, "int_equal_or_greater_than"), type);
+            case BinOp::EQ:
+                return compareResult(Builder.CreateICmpEQ(L, R, "int_equal"), type);
+            case BinOp::NE:
+                return compareResult(Builder.CreateICmpNE(L, R, "int_not_equal"), type);
+            default:
+                return LogErrorV("invalid binary operator");
+        }
+    } else if (elemType == BOOL) {
+        switch (Op) {
+            case BinOp::EQ:
+                return Builder.CreateICmpEQ(L, R, "bool_equal");
+            case BinOp::NE:
+                return Builder.CreateICmpNE(L, R, "bool_not_equal");
+            default:
+                return LogErrorV("invalid binary operator");
         }
     } else {
         return LogErrorV("invalid type of return value");
@@ -229,62 +417,613 @@ Value *BinaryAST::codegen() {
         // CreateICmpの返り値がi1(1bit)なので、CreateIntCastはそれをint64にcastするのに用います。
 }
 
+// ExprAST::codegenCondBr - 値をcodegenして分岐する。boolならi1をそのまま使い、
+// intとdouble(以前のプログラムの条件)は0と比べる。
+bool ExprAST::codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    Value *CondV = codegen();
+    if (!CondV)
+        return false;
+    if (type == INT) {
+        CondV = Builder.CreateICmpNE(CondV, ConstantInt::get(Context, APInt(64, 0)), "if_condition");
+    } else if (type == DOUBLE) {
+        CondV = Builder.CreateFCmpUNE(CondV, ConstantFP::get(Context, APFloat(0.0)), "if_condition");
+    } else if (type != BOOL) {
+        LogError("illegal type of condition");
+        return false;
+    }
+    // condition, trueだった場合のブロック、falseだった場合のブロックを登録する。
+    // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html#a3393497feaca1880ab3168ee3db1d7a4
+    Builder.CreateCondBr(CondV, TrueBB, FalseBB);
+    return true;
+}
+
+// BinaryAST::codegenCondBr - `a && b`は、aが真ならbを調べるブロックに、偽なら直接FalseBBに
+// 分岐する(||はその逆)。値のphiを作らないので、条件の比較がそのまま分岐になる。
+bool BinaryAST::codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    if (!isLogical(Op))
+        return ExprAST::codegenCondBr(TrueBB, FalseBB);
+    bool isAnd = Op == BinOp::And;
+    BasicBlock *RHSBB = BasicBlock::Create(Context, isAnd ? "and_rhs" : "or_rhs");
+    if (!(isAnd ? LHS->codegenCondBr(RHSBB, FalseBB) : LHS->codegenCondBr(TrueBB, RHSBB)))
+        return false;
+    Builder.GetInsertBlock()->getParent()->getBasicBlockList().push_back(RHSBB);
+    Builder.SetInsertPoint(RHSBB);
+    return RHS->codegenCondBr(TrueBB, FalseBB);
+}
+
+Value *NotExprAST::codegen() {
+    Value *V = Operand->codegen();
+    if (!V)
+        return nullptr;
+    return Builder.CreateNot(V, "not");
+}
+
+// NotExprAST::codegenCondBr - 分岐先を入れ替えるだけで、xorは作らない。
+bool NotExprAST::codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    return Operand->codegenCondBr(FalseBB, TrueBB);
+}
+
 Function *PrototypeAST::codegen() {
     Type *retType = cvtNumTypeToType(type);
 
+    // 配列の引数は、先頭のポインタと長さ(int)の二つの引数になる。
     std::vector<Type *> prototype;
     for (ArgTuple arg : ArgList) {
         NumType argNumType = arg.type;
         Type *argType = cvtNumTypeToType(arg.type);
         prototype.push_back(argType);
+        if (isArrayType(argNumType))
+            prototype.push_back(Type::getInt64Ty(Context));
     }
     FunctionType *FT =
         FunctionType::get(retType, prototype, false);
     // https://llvm.org/doxygen/classllvm_1_1Function.html
     // llvm::Functionは関数のIRを表現するクラス
     Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, myModule.get());
+        Function::Create(FT, Function::ExternalLinkage, Symbols.getName(Name),
+                myModule.get());
 
-    // 引数の名前を付ける
-    unsigned i = 0;
-    NamedValues.clear();
-    for (auto &arg : F->args()) {
-        arg.setName(ArgList[i].name);
-        VariableTuple vp = {&arg, ArgList[i].type};
-        NamedValues[ArgList[i].name] = vp;
-        i++;
+    // 引数の名前を付ける。配列の長さは"<名前>.len"にする。
+    // 配列のポインタには、他の引数の配列と重ならないこと(noalias)と、要素の大きさに
+    // アラインされていることを付ける。noaliasのおかげで、配列を読み書きするループは
+    // 実行時の重なりのチェック無しにベクトル化できる。
+    auto AI = F->arg_begin();
+    for (const ArgTuple &arg : ArgList) {
+        StringRef name = Symbols.getName(arg.name);
+        AI->setName(name);
+        // boolはC++のboolと同じく、上位のビットを0で埋めて渡す(zeroext)。
+        if (arg.type == BOOL)
+            AI->addAttr(Attribute::ZExt);
+        if (isArrayType(arg.type)) {
+            AI->addAttr(Attribute::NoAlias);
+            AI->addAttr(Attribute::getWithAlignment(Context, 8));
+            ++AI;
+            AI->setName(name + ".len");
+        }
+        ++AI;
     }
+    if (type == BOOL)
+        F->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+    return F;
+}
+
+//===----------------------------------------------------------------------===//
+// Memoization
+// "def memo int fib(int x)"のようにmemoが付いた関数は、引数をキーにして結果をキャッシュする。
+// bodyは"fib.memo_impl"という内部関数になり、"fib"はキャッシュを引いて見つからなかった
+// 時だけfib.memo_implを呼ぶラッパーになる。bodyの中の再帰呼び出しもラッパーを通る。
+//
+// キャッシュはスレッド毎(thread_local)に持つので、実行時にロックは要らない。
+// - 引数がint一つで0 <= x < MemoDenseSizeの場合は、xをそのまま添字にする配列(dense table)
+// - それ以外はオープンアドレス法(線形探査)のハッシュテーブル。MemoMaxProbe個のスロットを
+//   探して空きが無ければ最初のスロットを上書きする(キャッシュなので古い値は捨ててよい)。
+//===----------------------------------------------------------------------===//
+
+static const uint64_t MemoDenseSize = 4096;
+static const uint64_t MemoHashSize = 4096; // 2のべき乗にすること
+static const uint64_t MemoMaxProbe = 8;
+
+// PureFunctions - 副作用が無く、同じ引数に対して常に同じ値を返す事が分かっている関数
+static thread_local std::set<Symbol> PureFunctions;
+
+static GlobalVariable *createMemoTable(const std::string &Name, Type *ElemTy,
+        uint64_t Size) {
+    ArrayType *Ty = ArrayType::get(ElemTy, Size);
+    auto *GV = new GlobalVariable(*myModule, Ty, false, GlobalValue::InternalLinkage,
+            ConstantAggregateZero::get(Ty), Name);
+    // JITはスレッドローカル変数に対応していないので、output.oを出力する時だけにする。
+    if (Mode == RUN_OBJECT)
+        GV->setThreadLocal(true);
+    return GV;
+}
+
+// emitMemoWrapper - 空の関数Wrapperに、キャッシュを引いてImplを呼ぶbodyを作る。
+static void emitMemoWrapper(Function *Wrapper, Function *Impl) {
+    const std::string Name = Wrapper->getName().str();
+    Type *RetTy = Wrapper->getReturnType();
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", Wrapper));
+    Type *Int8Ty = B.getInt8Ty();
+    Type *Int64Ty = B.getInt64Ty();
+
+    std::vector<Value *> args;
+    for (auto &arg : Wrapper->args())
+        args.push_back(&arg);
+
+    BasicBlock *HashBB = BasicBlock::Create(Context, "hash", Wrapper);
+
+    // dense table: 負の数はunsignedで比較すると大きな数になるので、一回の比較で範囲を調べられる。
+    if (args.size() == 1 && args[0]->getType()->isIntegerTy(64)) {
+        GlobalVariable *Vals = createMemoTable(Name + ".memo.dense_vals", RetTy, MemoDenseSize);
+        GlobalVariable *Used = createMemoTable(Name + ".memo.dense_used", Int8Ty, MemoDenseSize);
+        BasicBlock *DenseBB = BasicBlock::Create(Context, "dense", Wrapper);
+        BasicBlock *HitBB = BasicBlock::Create(Context, "dense_hit", Wrapper);
+        BasicBlock *MissBB = BasicBlock::Create(Context, "dense_miss", Wrapper);
+
+        Value *InRange = B.CreateICmpULT(args[0], B.getInt64(MemoDenseSize), "in_dense_range");
+        B.CreateCondBr(InRange, DenseBB, HashBB);
+
+        B.SetInsertPoint(DenseBB);
+        Value *Idx[] = {B.getInt64(0), args[0]};
+        Value *UsedP = B.CreateInBoundsGEP(Used->getValueType(), Used, Idx);
+        Value *ValP = B.CreateInBoundsGEP(Vals->getValueType(), Vals, Idx);
+        Value *IsCached = B.CreateICmpNE(B.CreateLoad(Int8Ty, UsedP), B.getInt8(0), "is_cached");
+        B.CreateCondBr(IsCached, HitBB, MissBB);
+
+        B.SetInsertPoint(HitBB);
+        B.CreateRet(B.CreateLoad(RetTy, ValP, "cached"));
+
+        B.SetInsertPoint(MissBB);
+        Value *Result = B.CreateCall(Impl, args, "result");
+        B.CreateStore(Result, ValP);
+        B.CreateStore(B.getInt8(1), UsedP);
+        B.CreateRet(Result);
+    } else {
+        B.CreateBr(HashBB);
+    }
+
+    // hash table: キーは引数をi64にしたもの(doubleはビット列をそのまま使い、boolは0か1)。
+    B.SetInsertPoint(HashBB);
+    ArrayType *KeyTy = ArrayType::get(Int64Ty, std::max<size_t>(args.size(), 1));
+    GlobalVariable *Keys = createMemoTable(Name + ".memo.keys", KeyTy, MemoHashSize);
+    GlobalVariable *Vals = createMemoTable(Name + ".memo.vals", RetTy, MemoHashSize);
+    GlobalVariable *Used = createMemoTable(Name + ".memo.used", Int8Ty, MemoHashSize);
+
+    // 各キーを混ぜた後、murmur3のfinalizer(fmix64)で全ビットを下位ビットに行き渡らせる。
+    // doubleの小さな整数値は下位ビットが全て0なので、これをしないと全て同じスロットになる。
+    std::vector<Value *> keys;
+    Value *Hash = B.getInt64(0x9e3779b97f4a7c15ULL);
+    for (Value *arg : args) {
+        Value *Key = arg->getType()->isDoubleTy() ? B.CreateBitCast(arg, Int64Ty) :
+            B.CreateZExt(arg, Int64Ty);
+        keys.push_back(Key);
+        Hash = B.CreateMul(B.CreateXor(Hash, Key), B.getInt64(0x9e3779b97f4a7c15ULL));
+    }
+    Hash = B.CreateXor(Hash, B.CreateLShr(Hash, 33));
+    Hash = B.CreateMul(Hash, B.getInt64(0xff51afd7ed558ccdULL));
+    Hash = B.CreateXor(Hash, B.CreateLShr(Hash, 33));
+    Hash = B.CreateMul(Hash, B.getInt64(0xc4ceb9fe1a85ec53ULL));
+    Hash = B.CreateXor(Hash, B.CreateLShr(Hash, 33));
+    Value *Mask = B.getInt64(MemoHashSize - 1);
+    Value *Home = B.CreateAnd(Hash, Mask, "home_slot");
+
+    BasicBlock *ProbeBB = BasicBlock::Create(Context, "probe", Wrapper);
+    BasicBlock *CheckBB = BasicBlock::Create(Context, "check_key", Wrapper);
+    BasicBlock *NextBB = BasicBlock::Create(Context, "next_slot", Wrapper);
+    BasicBlock *HitBB = BasicBlock::Create(Context, "hash_hit", Wrapper);
+    BasicBlock *MissBB = BasicBlock::Create(Context, "hash_miss", Wrapper);
+    B.CreateBr(ProbeBB);
+
+    B.SetInsertPoint(ProbeBB);
+    PHINode *Probe = B.CreatePHI(Int64Ty, 2, "probe");
+    Probe->addIncoming(B.getInt64(0), HashBB);
+    Value *Slot = B.CreateAnd(B.CreateAdd(Home, Probe), Mask, "slot");
+    Value *SlotIdx[] = {B.getInt64(0), Slot};
+    Value *UsedP = B.CreateInBoundsGEP(Used->getValueType(), Used, SlotIdx);
+    Value *IsUsed = B.CreateICmpNE(B.CreateLoad(Int8Ty, UsedP), B.getInt8(0), "is_used");
+    B.CreateCondBr(IsUsed, CheckBB, MissBB);
+
+    B.SetInsertPoint(CheckBB);
+    Value *Match = B.getTrue();
+    for (size_t i = 0; i < keys.size(); i++) {
+        Value *KeyIdx[] = {B.getInt64(0), Slot, B.getInt64(i)};
+        Value *KeyP = B.CreateInBoundsGEP(Keys->getValueType(), Keys, KeyIdx);
+        Match = B.CreateAnd(Match, B.CreateICmpEQ(B.CreateLoad(Int64Ty, KeyP), keys[i]));
+    }
+    B.CreateCondBr(Match, HitBB, NextBB);
+
+    B.SetInsertPoint(HitBB);
+    Value *HitValP = B.CreateInBoundsGEP(Vals->getValueType(), Vals, SlotIdx);
+    B.CreateRet(B.CreateLoad(RetTy, HitValP, "cached"));
+
+    B.SetInsertPoint(NextBB);
+    Value *NextProbe = B.CreateAdd(Probe, B.getInt64(1));
+    Probe->addIncoming(NextProbe, NextBB);
+    B.CreateCondBr(B.CreateICmpULT(NextProbe, B.getInt64(MemoMaxProbe)), ProbeBB, MissBB);
+
+    // 空きスロットが見つかったらそこに、見つからなければ最初のスロットに書き込む。
+    B.SetInsertPoint(MissBB);
+    PHINode *InsertSlot = B.CreatePHI(Int64Ty, 2, "insert_slot");
+    InsertSlot->addIncoming(Slot, ProbeBB);
+    InsertSlot->addIncoming(Home, NextBB);
+    Value *Result = B.CreateCall(Impl, args, "result");
+    Value *InsertIdx[] = {B.getInt64(0), InsertSlot};
+    for (size_t i = 0; i < keys.size(); i++) {
+        Value *KeyIdx[] = {B.getInt64(0), InsertSlot, B.getInt64(i)};
+        B.CreateStore(keys[i], B.CreateInBoundsGEP(Keys->getValueType(), Keys, KeyIdx));
+    }
+    B.CreateStore(Result, B.CreateInBoundsGEP(Vals->getValueType(), Vals, InsertIdx));
+    B.CreateStore(B.getInt8(1), B.CreateInBoundsGEP(Used->getValueType(), Used, InsertIdx));
+    B.CreateRet(Result);
+}
+
+//===----------------------------------------------------------------------===//
+// Call profiling
+// --profile-callsを指定すると、各関数の呼び出し回数と、呼び出しにかかったサイクル数
+// (readcyclecounter。x86-64ではrdtsc)の合計を数える。
+// 関数fooのカウンタは以下のレコードで、コンストラクタ(__mc_profile_ctor.foo)が
+// 起動時にリストにつなぐ。
+//   struct { i8 *next; const char *name; uint64_t calls; uint64_t cycles; } __mc_profile.foo;
+// サイクル数は呼び出し先の関数の分も含む。再帰呼び出しでは内側の呼び出しの分も重ねて足す。
+// カウンタはatomicrmw addで足すので、複数のスレッドから呼んでも数え落とさない。
+//
+// 実行時に必要な関数もModuleに作る(C++側でのリンクの指定は要らない)。
+//   void mc_profile_dump(void) : リストの全ての関数を"function,calls,cycles"のCSVで
+//                                標準エラー出力に書く。終了時にもatexitで呼ばれる。
+// これらとリストの先頭はweak_odrなので、複数のoutput.oをリンクしても一つになる。
+//===----------------------------------------------------------------------===//
+
+// getProfileRecordType - カウンタのレコードの型
+static StructType *getProfileRecordType() {
+    Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    return StructType::get(Context, {Int8PtrTy, Int8PtrTy, Int64Ty, Int64Ty});
+}
+
+// getProfileHead - 全ての関数のレコードのリストの先頭
+static GlobalVariable *getProfileHead(Module &M) {
+    Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+    if (GlobalVariable *GV = M.getNamedGlobal("__mc_profile_head"))
+        return GV;
+    return new GlobalVariable(M, Int8PtrTy, false, GlobalValue::WeakODRLinkage,
+            ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)), "__mc_profile_head");
+}
+
+// getProfileDump - mc_profile_dumpを作る。
+static Function *getProfileDump(Module &M) {
+    if (Function *F = M.getFunction("mc_profile_dump"))
+        return F;
+    Type *Int32Ty = Type::getInt32Ty(Context);
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+    StructType *RecTy = getProfileRecordType();
+    FunctionCallee Dprintf = M.getOrInsertFunction("dprintf",
+            FunctionType::get(Int32Ty, {Int32Ty, Int8PtrTy}, true));
+
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(Context), false),
+            Function::WeakODRLinkage, "mc_profile_dump", &M);
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", F));
+    BasicBlock *LoopBB = BasicBlock::Create(Context, "record", F);
+    BasicBlock *ExitBB = BasicBlock::Create(Context, "done", F);
+    Constant *Stderr = ConstantInt::get(Int32Ty, 2);
+    B.CreateCall(Dprintf, {Stderr, B.CreateGlobalStringPtr("function,calls,cycles\n")});
+    Value *Fmt = B.CreateGlobalStringPtr("%s,%llu,%llu\n");
+    Value *Head = B.CreateLoad(Int8PtrTy, getProfileHead(M), "head");
+    B.CreateCondBr(B.CreateIsNull(Head), ExitBB, LoopBB);
+
+    BasicBlock *EntryBB = B.GetInsertBlock();
+    B.SetInsertPoint(LoopBB);
+    PHINode *Cur = B.CreatePHI(Int8PtrTy, 2, "cur");
+    Cur->addIncoming(Head, EntryBB);
+    Value *Rec = B.CreateBitCast(Cur, RecTy->getPointerTo());
+    auto loadField = [&](unsigned i, Type *Ty, const char *name) -> Value * {
+        LoadInst *L = B.CreateLoad(Ty, B.CreateStructGEP(RecTy, Rec, i), name);
+        // 他のスレッドが足している途中でも読めるようにする。
+        if (Ty == Int64Ty) {
+            L->setAlignment(8);
+            L->setAtomic(AtomicOrdering::Monotonic);
+        }
+        return L;
+    };
+    Value *Name = loadField(1, Int8PtrTy, "name");
+    Value *Calls = loadField(2, Int64Ty, "calls");
+    Value *Cycles = loadField(3, Int64Ty, "cycles");
+    B.CreateCall(Dprintf, {Stderr, Fmt, Name, Calls, Cycles});
+    Value *Next = loadField(0, Int8PtrTy, "next");
+    Cur->addIncoming(Next, LoopBB);
+    B.CreateCondBr(B.CreateIsNull(Next), ExitBB, LoopBB);
+
+    B.SetInsertPoint(ExitBB);
+    B.CreateRetVoid();
+    return F;
+}
+
+// getProfileRegister - レコードをリストにつなぐ__mc_profile_registerを作る。
+// 最初のレコードをつなぐ時に、mc_profile_dumpを終了時に呼ぶようatexitで登録する。
+// 同じレコードを二度つなぐとリストが循環するので、既につないだレコードは無視する。
+static Function *getProfileRegister(Module &M) {
+    if (Function *F = M.getFunction("__mc_profile_register"))
+        return F;
+    Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+    Type *VoidTy = Type::getVoidTy(Context);
+    StructType *RecTy = getProfileRecordType();
+    Function *Dump = getProfileDump(M);
+    FunctionCallee Atexit = M.getOrInsertFunction("atexit",
+            FunctionType::get(Type::getInt32Ty(Context), {Dump->getType()}, false));
+
+    Function *F = Function::Create(FunctionType::get(VoidTy, {RecTy->getPointerTo()}, false),
+            Function::WeakODRLinkage, "__mc_profile_register", &M);
+    F->setVisibility(GlobalValue::HiddenVisibility);
+    Argument *Rec = &*F->arg_begin();
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", F));
+    BasicBlock *FirstBB = BasicBlock::Create(Context, "first", F);
+    BasicBlock *CheckBB = BasicBlock::Create(Context, "check", F);
+    BasicBlock *LinkBB = BasicBlock::Create(Context, "link", F);
+    BasicBlock *ExitBB = BasicBlock::Create(Context, "done", F);
+
+    GlobalVariable *HeadVar = getProfileHead(M);
+    Value *Head = B.CreateLoad(Int8PtrTy, HeadVar, "head");
+    B.CreateCondBr(B.CreateIsNull(Head), FirstBB, CheckBB);
+
+    B.SetInsertPoint(FirstBB);
+    B.CreateCall(Atexit, {Dump});
+    B.CreateBr(LinkBB);
+
+    B.SetInsertPoint(CheckBB);
+    Value *NextP = B.CreateStructGEP(RecTy, Rec, 0);
+    Value *Linked = B.CreateOr(B.CreateIsNotNull(B.CreateLoad(Int8PtrTy, NextP)),
+            B.CreateICmpEQ(Head, B.CreateBitCast(Rec, Int8PtrTy)), "linked");
+    B.CreateCondBr(Linked, ExitBB, LinkBB);
+
+    B.SetInsertPoint(LinkBB);
+    B.CreateStore(Head, B.CreateStructGEP(RecTy, Rec, 0));
+    B.CreateStore(B.CreateBitCast(Rec, Int8PtrTy), HeadVar);
+    B.CreateBr(ExitBB);
+
+    B.SetInsertPoint(ExitBB);
+    B.CreateRetVoid();
     return F;
 }
 
+// instrumentCalls - Fの入口で呼び出し回数を数えてサイクル数を読み、各returnの前で
+// かかったサイクル数を足す。Fのbodyを作り終わった後に呼ぶ。
+static void instrumentCalls(Function &F) {
+    Module &M = *F.getParent();
+    const std::string Name = F.getName().str();
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    StructType *RecTy = getProfileRecordType();
+
+    IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+    Constant *Init = ConstantStruct::get(RecTy, {
+            ConstantPointerNull::get(Type::getInt8PtrTy(Context)),
+            cast<Constant>(B.CreateGlobalStringPtr(Name, Name + ".profile_name")),
+            ConstantInt::get(Int64Ty, 0), ConstantInt::get(Int64Ty, 0)});
+    auto *Rec = new GlobalVariable(M, RecTy, false, GlobalValue::InternalLinkage,
+            Init, "__mc_profile." + Name);
+    Rec->setAlignment(8);
+
+    // 起動時にレコードをリストにつなぐコンストラクタ
+    Function *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(Context), false),
+            Function::InternalLinkage, "__mc_profile_ctor." + Name, &M);
+    IRBuilder<> CB(BasicBlock::Create(Context, "entry", Ctor));
+    CB.CreateCall(getProfileRegister(M), {Rec});
+    CB.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, 0);
+
+    Function *ReadCycles = Intrinsic::getDeclaration(&M, Intrinsic::readcyclecounter);
+    B.CreateAtomicRMW(AtomicRMWInst::Add, B.CreateStructGEP(RecTy, Rec, 2),
+            ConstantInt::get(Int64Ty, 1), AtomicOrdering::Monotonic);
+    Value *Start = B.CreateCall(ReadCycles, {}, "profile_start");
+
+    std::vector<ReturnInst *> Returns;
+    for (BasicBlock &BB : F) {
+        if (auto *RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+            Returns.push_back(RI);
+    }
+    for (ReturnInst *RI : Returns) {
+        B.SetInsertPoint(RI);
+        Value *Elapsed = B.CreateSub(B.CreateCall(ReadCycles, {}, "profile_end"), Start,
+                "profile_cycles");
+        B.CreateAtomicRMW(AtomicRMWInst::Add, B.CreateStructGEP(RecTy, Rec, 3), Elapsed,
+                AtomicOrdering::Monotonic);
+    }
+}
+
+// applyFPMode - IRBuilderが作る浮動小数点数の演算に、modeに応じたfast-math flagsを付ける
+// ようにする。FP_FASTの場合は、バックエンドも同じ仮定をできるよう関数の属性も付ける
+// (clangの-ffast-mathと同じ属性)。FP_CONTRACTでFMA命令が使われるのは、-march=で
+// FMAのあるCPUを指定した場合だけ。
+static void applyFPMode(Function &F, FPMode mode) {
+    FastMathFlags FMF;
+    if (mode == FP_FAST) {
+        FMF.setFast();
+        F.addFnAttr("unsafe-fp-math", "true");
+        F.addFnAttr("no-infs-fp-math", "true");
+        F.addFnAttr("no-nans-fp-math", "true");
+        F.addFnAttr("no-signed-zeros-fp-math", "true");
+    } else if (mode == FP_CONTRACT) {
+        FMF.setAllowContract(true);
+    }
+    Builder.setFastMathFlags(FMF);
+}
+
+// promoteAllocas - varの変数のallocaをmem2regでレジスタに昇格させる。
+// 最適化のパイプライン(-O1以上のSROA)に任せず常に行うので、-O0でもload/storeは残らない。
+static void promoteAllocas(Function &F) {
+    std::vector<AllocaInst *> Allocas;
+    for (Instruction &I : F.getEntryBlock()) {
+        if (auto *Alloca = dyn_cast<AllocaInst>(&I)) {
+            if (isAllocaPromotable(Alloca))
+                Allocas.push_back(Alloca);
+        }
+    }
+    if (Allocas.empty())
+        return;
+    DominatorTree DT(F);
+    PromoteMemToReg(Allocas, DT);
+}
+
 Function *FunctionAST::codegen() {
-    // この関数が既にModuleに登録されているか確認
-    Function *function = myModule->getFunction(proto->getFunctionName());
-    // 関数名が見つからなかったら、新しくこの関数のIRクラスを作る。
-    if (!function)
-        function = proto->codegen();
+    // 意味解析。シグネチャを登録し、全てのノードの型を決める。
+    {
+        TimePhase T(SemaTimer);
+        if (!analyze())
+            return nullptr;
+    }
+
+    // 引数が定数の関数呼び出し等をコンパイル時に計算しておく。
+    // 型の決まったASTを畳み込むので、型エラーのある式が畳み込まれて消えることは無い。
+    {
+        TimePhase T(FoldTimer);
+        foldFunctionBody(body);
+    }
+
+    TimePhase T(IRGenTimer);
+
+    // この関数のIRクラスを得る。
+    // 関数名が見つからなかったら、getFunctionが新しく作る。
+    Symbol Sym = proto->getName();
+    const std::string Name = proto->getFunctionName().str();
+    Function *function = getFunction(Sym);
     if (!function)
         return nullptr;
 
+    // bodyの中で呼んでいる関数が全て純粋なら、この関数も純粋。
+    // memoが付いている場合は純粋でなければキャッシュできないのでエラーにする。
+    std::set<Symbol> callees;
+    body->collectCallees(callees);
+    Symbol impureCallee = EmptySymbol;
+    for (Symbol callee : callees) {
+        if (callee != Sym && PureFunctions.count(callee) == 0) {
+            impureCallee = callee;
+            break;
+        }
+    }
+    bool memo = proto->hasAttribute(ATTR_MEMO);
+    if (memo) {
+        if (proto->hasAttribute(ATTR_TAILREC)) {
+            LogError(("function '" + Name + "' cannot be both memo and tailrec").c_str());
+            function->eraseFromParent();
+            return nullptr;
+        }
+        bool scalarArgs = true;
+        for (const ArgTuple &arg : proto->getArgs())
+            scalarArgs &= arg.type == INT || arg.type == DOUBLE || arg.type == BOOL;
+        if (!scalarArgs) {
+            LogError(("function '" + Name + "' is marked memo but takes an array or a vector")
+                    .c_str());
+            function->eraseFromParent();
+            return nullptr;
+        }
+        if (impureCallee != EmptySymbol) {
+            LogError(("function '" + Name + "' is marked memo but calls '" +
+                        Symbols.getName(impureCallee).str() +
+                        "', which is not known to be pure").c_str());
+            function->eraseFromParent();
+            return nullptr;
+        }
+    }
+
+    // 自分自身への呼び出しが末尾位置にあるかを調べる。
+    // tailrecが付いているのに末尾位置以外で自分を呼んでいたらエラーにする。
+    // memoの場合、再帰呼び出しはキャッシュを通す必要があるのでループにはしない。
+    TailCallInfo tailInfo;
+    if (!memo)
+        body->analyzeTailCalls(Sym, true, tailInfo);
+    if (proto->hasAttribute(ATTR_TAILREC)) {
+        if (tailInfo.nonTailCalls > 0) {
+            LogError(("function '" + Name + "' is marked tailrec but calls itself "
+                        "in a non-tail position").c_str());
+            function->eraseFromParent();
+            return nullptr;
+        }
+        if (tailInfo.tailCalls == 0)
+            LogWarning("function '" + Name + "' is marked tailrec but never calls itself");
+    }
+
+    // 浮動小数点数の演算のモードを設定する。Builderの設定はこの関数のcodegenの間だけ有効。
+    IRBuilder<>::FastMathFlagGuard FMFGuard(Builder);
+    applyFPMode(*function, proto->getFPMode());
+
     // エントリーポイントを作る
     BasicBlock *BB = BasicBlock::Create(Context, "entry", function);
     Builder.SetInsertPoint(BB);
 
-    // 関数のbody(ExprASTから継承されたNumberASTかBinaryAST)をcodegenする
-    if (function->getReturnType() != cvtNumTypeToType(body->checkType())) { 
-        //定義された返り値の型と、bodyの型が異なっていたらエラー
-        LogError("illegal definition of function. defined type of return value is different from body type.");
-        return nullptr;
+    // 引数をNamedValuesに登録する
+    // 末尾再帰を含む場合は、entryの次にループの先頭("tailrecurse")を作り、
+    // 引数の代わりにループを回る度に値が変わるphiを登録する。
+    TailRecLoop loop;
+    if (tailInfo.tailCalls > 0) {
+        loop.header = BasicBlock::Create(Context, "tailrecurse", function);
+        Builder.CreateBr(loop.header);
+        Builder.SetInsertPoint(loop.header);
     }
+    auto bindArg = [&](Argument &arg) -> Value * {
+        if (tailInfo.tailCalls == 0)
+            return &arg;
+        PHINode *PN = Builder.CreatePHI(arg.getType(), 2, arg.getName());
+        PN->addIncoming(&arg, BB);
+        loop.args.push_back(PN);
+        return PN;
+    };
+    VarScope Scope(NamedValues);
+    auto AI = function->arg_begin();
+    for (const ArgTuple &argTuple : proto->getArgs()) {
+        VariableTuple vp = {bindArg(*AI++), argTuple.type, nullptr};
+        // 配列は次の引数が長さ
+        if (isArrayType(argTuple.type))
+            vp.length = bindArg(*AI++);
+        NamedValues.insert(argTuple.name, vp);
+    }
+
+    // 関数のbody(ExprASTから継承されたNumberASTかBinaryAST)をcodegenする
+    CurTailRec = tailInfo.tailCalls > 0 ? &loop : nullptr;
     Value *RetVal = body->codegen();
+    CurTailRec = nullptr;
     if (RetVal) {
         // returnのIRを作る
-        Builder.CreateRet(RetVal);
+        // 末尾位置のif文が既に各枝でreturnしている場合は何もしない。
+        if (!Builder.GetInsertBlock()->getTerminator())
+            Builder.CreateRet(RetVal);
+        promoteAllocas(*function);
 
         // https://llvm.org/doxygen/Verifier_8h.html
         // 関数の検証
-        verifyFunction(*function);
+        {
+            TimePhase T(VerifyTimer);
+            verifyFunction(*function);
+        }
 
+        // 配列を受け取る関数は配列を読み書きするので純粋ではない。
+        if (impureCallee == EmptySymbol && !proto->hasArrayArgs())
+            PureFunctions.insert(Sym);
+
+        // memoの場合、今作った関数をfib.memo_implにして、キャッシュを引くラッパーを
+        // 元の名前で作る。再帰呼び出しもラッパーを呼ぶように付け替える。
+        if (memo) {
+            function->setName(Name + ".memo_impl");
+            function->setLinkage(GlobalValue::InternalLinkage);
+            Function *wrapper = Function::Create(function->getFunctionType(),
+                    Function::ExternalLinkage, Name, myModule.get());
+            wrapper->setAttributes(function->getAttributes());
+            function->replaceAllUsesWith(wrapper);
+            emitMemoWrapper(wrapper, function);
+            if (ProfileCalls)
+                instrumentCalls(*wrapper);
+            {
+                TimePhase T(VerifyTimer);
+                verifyFunction(*wrapper);
+            }
+            Stats.functions++;
+            Stats.irInstructions += function->getInstructionCount() + wrapper->getInstructionCount();
+            return wrapper;
+        }
+
+        // トップレベルの式(__anon_exprN)は数えない。
+        if (ProfileCalls && !StringRef(Name).startswith("__"))
+            instrumentCalls(*function);
+
+        Stats.functions++;
+        Stats.irInstructions += function->getInstructionCount();
         return function;
     }
 
@@ -294,42 +1033,36 @@ Function *FunctionAST::codegen() {
 }
 
 Value *IfExprAST::codegen() {
-    NumType type = Cond->checkType();
-    Value *CondV = Cond->codegen();
-    if (!CondV)
-        return nullptr;
-    if (type == INT) {
-        CondV = Builder.CreateICmpNE(CondV, ConstantInt::get(Context, APInt(64, 0)), "if_condition");
-    } else if (type == DOUBLE) {
-        CondV = Builder.CreateFCmpUNE(CondV, ConstantFP::get(Context, APFloat(0.0)), "if_condition");
-    } else {
-        return LogErrorV("illegal type of condition");
-    }
     // if文を呼んでいる関数の名前
     Function *ParentFunc = Builder.GetInsertBlock()->getParent();
 
     // "thenだった場合"と"elseだった場合"のブロックを作り、ラベルを付ける。
     // "ifcont"はif文が"then"と"else"の処理の後、二つのコントロールフローを
     // マージするブロック。
-    BasicBlock *ThenBB =
-        BasicBlock::Create(Context, "then", ParentFunc);
+    BasicBlock *ThenBB = BasicBlock::Create(Context, "then");
     BasicBlock *ElseBB = BasicBlock::Create(Context, "else");
     BasicBlock *MergeBB = BasicBlock::Create(Context, "ifcont");
-    // condition, trueだった場合のブロック、falseだった場合のブロックを登録する。
-    // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html#a3393497feaca1880ab3168ee3db1d7a4
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+    // conditionを計算してThenBBかElseBBに分岐する。比較の結果(i1)はそのまま分岐に使い、
+    // &&や||は条件毎に直接分岐する(codegenCondBr)。
+    if (!Cond->codegenCondBr(ThenBB, ElseBB))
+        return nullptr;
 
     // "then"のブロックを作り、その内容(expression)をcodegenする。
+    ParentFunc->getBasicBlockList().push_back(ThenBB);
     Builder.SetInsertPoint(ThenBB);
-    NumType typeT = Then->checkType();
-    if (typeT == INT && type == DOUBLE) {
-        LogErrorV("Cannot convert 'double' to 'int'. Please set same type in THEN value and ELSE value.");
-    }
     Value *ThenV = Then->codegen();
     if (!ThenV)
         return nullptr;
-    // "then"のブロックから出る時は"ifcont"ブロックに飛ぶ。
-    Builder.CreateBr(MergeBB);
+    // 末尾再帰をループにしている関数の末尾位置では、枝毎にreturnする。
+    // (枝が末尾呼び出しで既にループの先頭に飛んでいる場合は何もしない。)
+    bool retInBranch = isTail && CurTailRec;
+    if (retInBranch) {
+        if (!Builder.GetInsertBlock()->getTerminator())
+            Builder.CreateRet(ThenV);
+    } else {
+        // "then"のブロックから出る時は"ifcont"ブロックに飛ぶ。
+        Builder.CreateBr(MergeBB);
+    }
     // ThenBBをアップデートする。
     ThenBB = Builder.GetInsertBlock();
 
@@ -338,13 +1071,16 @@ Value *IfExprAST::codegen() {
     // 注意: 20行下のコメントアウトを外して下さい。
     ParentFunc->getBasicBlockList().push_back(ElseBB);
     Builder.SetInsertPoint(ElseBB);
-    NumType typeE = Else->checkType();
-    if (typeE == INT && type == DOUBLE) {
-        LogErrorV("Cannot convert 'double' to 'int'. Please set same type in THEN value and ELSE value.");
-    }
     Value *ElseV = Else->codegen();
     if (!ElseV)
         return nullptr;
+    if (retInBranch) {
+        if (!Builder.GetInsertBlock()->getTerminator())
+            Builder.CreateRet(ElseV);
+        // 両方の枝が終端しているので"ifcont"ブロックは作らない。
+        delete MergeBB;
+        return UndefValue::get(ParentFunc->getReturnType());
+    }
     Builder.CreateBr(MergeBB);
     ElseBB = Builder.GetInsertBlock();
 
@@ -359,8 +1095,9 @@ Value *IfExprAST::codegen() {
     // LLVM IRはSSAという"全ての変数が一度だけassignされる"規約があるため、
     // 値を上書きすることが出来ません。従って、このように実行時にコントロールフローの
     // 値を選択する機能が必要です。
+    // phiの型は"then"と"else"の値の型(analyzeで同じ型であることを確認済み)。
     PHINode *PN =
-        Builder.CreatePHI(Type::getDoubleTy(Context), 2, "iftmp");
+        Builder.CreatePHI(cvtNumTypeToType(type), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     // TODO 3.4:を実装したらコメントアウトを外して下さい。
@@ -369,33 +1106,263 @@ Value *IfExprAST::codegen() {
     return PN;
 }
 
+// ForExprAST::codegen - ループを、ループ最適化(LoopVectorize等)がそのまま扱える
+// 標準的な形にする。
+//
+//   entry:        start, end, stepを計算し、一度も回らなければfor_exitに飛ぶ
+//   for_preheader: ループの唯一の入口
+//   for_loop:     i = phi [start, for_preheader], [next, latch]
+//                 acc = phi [0, for_preheader], [sum, latch]
+//                 sum = acc + body; next = i + step
+//                 next < endならfor_loopに戻る(latch。bodyが分岐を含む場合はその最後のブロック)
+//   for_exit:     phi [0, entry], [sum, latch]
+//
+// 条件をループの最後で調べる(rotateした)形なので、ループの中の分岐はlatchの一つだけになる。
+// ヒントが付いている場合は、latchの分岐にllvm.loopのメタデータを付ける。
+Value *ForExprAST::codegen() {
+    Value *StartV = Start->codegen();
+    if (!StartV)
+        return nullptr;
+    Value *EndV = End->codegen();
+    if (!EndV)
+        return nullptr;
+    Value *StepV;
+    if (Step) {
+        StepV = Step->codegen();
+        if (!StepV)
+            return nullptr;
+    } else if (Start->type == INT) {
+        StepV = ConstantInt::get(Context, APInt(64, 1));
+    } else {
+        StepV = ConstantFP::get(Context, APFloat(1.0));
+    }
+
+    // intの比較はsigned(ループの回数をLLVMが計算できるように)、doubleはordered。
+    // stepが正ならi < end、負ならi > endの間回り、0やNaNなら回らない。
+    // stepが定数なら符号の比較は畳み込まれ、どちらか一つの比較だけになる。
+    bool isInt = Start->type == INT;
+    Value *ZeroStep = Constant::getNullValue(StepV->getType());
+    Value *Ascending = isInt ? Builder.CreateICmpSGT(StepV, ZeroStep, "step_pos") :
+        Builder.CreateFCmpOGT(StepV, ZeroStep, "step_pos");
+    Value *Descending = isInt ? Builder.CreateICmpSLT(StepV, ZeroStep, "step_neg") :
+        Builder.CreateFCmpOLT(StepV, ZeroStep, "step_neg");
+    auto *AscendingC = dyn_cast<ConstantInt>(Ascending);
+    auto *DescendingC = dyn_cast<ConstantInt>(Descending);
+    auto inRange = [&](Value *I, const Twine &Name) -> Value * {
+        auto below = [&](const Twine &N) {
+            return isInt ? Builder.CreateICmpSLT(I, EndV, N) : Builder.CreateFCmpOLT(I, EndV, N);
+        };
+        auto above = [&](const Twine &N) {
+            return isInt ? Builder.CreateICmpSGT(I, EndV, N) : Builder.CreateFCmpOGT(I, EndV, N);
+        };
+        if (AscendingC && DescendingC) {
+            if (AscendingC->isOne())
+                return below(Name);
+            if (DescendingC->isOne())
+                return above(Name);
+            return Builder.getFalse();
+        }
+        Value *Up = Builder.CreateAnd(Ascending, below(Name + ".up"));
+        Value *Down = Builder.CreateAnd(Descending, above(Name + ".down"));
+        return Builder.CreateOr(Up, Down, Name);
+    };
+
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    Type *AccTy = cvtNumTypeToType(type);
+    Value *Zero = Constant::getNullValue(AccTy);
+    BasicBlock *GuardBB = Builder.GetInsertBlock();
+    BasicBlock *PreheaderBB = BasicBlock::Create(Context, "for_preheader", ParentFunc);
+    BasicBlock *LoopBB = BasicBlock::Create(Context, "for_loop", ParentFunc);
+    BasicBlock *ExitBB = BasicBlock::Create(Context, "for_exit");
+    Builder.CreateCondBr(inRange(StartV, "for_guard"), PreheaderBB, ExitBB);
+
+    Builder.SetInsertPoint(PreheaderBB);
+    Builder.CreateBr(LoopBB);
+
+    Builder.SetInsertPoint(LoopBB);
+    PHINode *Var = Builder.CreatePHI(StartV->getType(), 2, Symbols.getName(varName));
+    Var->addIncoming(StartV, PreheaderBB);
+    PHINode *Acc = Builder.CreatePHI(AccTy, 2, "for_acc");
+    Acc->addIncoming(Zero, PreheaderBB);
+
+    // ループ変数をbodyの中だけで見えるようにする(同じ名前の変数は隠す)。
+    Value *BodyV;
+    {
+        VarScope Scope(NamedValues);
+        NamedValues.insert(varName, {Var, Start->type, nullptr});
+        BodyV = Body->codegen();
+    }
+    if (!BodyV)
+        return nullptr;
+
+    Value *Sum, *Next;
+    if (getScalarType(type) == INT)
+        Sum = Builder.CreateAdd(Acc, BodyV, "for_sum");
+    else
+        Sum = Builder.CreateFAdd(Acc, BodyV, "for_sum");
+    if (isInt)
+        Next = Builder.CreateAdd(Var, StepV, "for_next");
+    else
+        Next = Builder.CreateFAdd(Var, StepV, "for_next");
+    BasicBlock *LatchBB = Builder.GetInsertBlock();
+    BranchInst *Latch = Builder.CreateCondBr(inRange(Next, "for_cond"), LoopBB, ExitBB);
+    Var->addIncoming(Next, LatchBB);
+    Acc->addIncoming(Sum, LatchBB);
+
+    // https://llvm.org/docs/LangRef.html#llvm-loop
+    // ループのメタデータは最初の要素が自分自身を指すdistinctなノードになる。
+    SmallVector<Metadata *, 4> LoopMD;
+    LoopMD.push_back(nullptr);
+    if (vectorize)
+        LoopMD.push_back(MDNode::get(Context, {
+                    MDString::get(Context, "llvm.loop.vectorize.enable"),
+                    ConstantAsMetadata::get(Builder.getTrue())}));
+    if (unrollCount > 0)
+        LoopMD.push_back(MDNode::get(Context, {
+                    MDString::get(Context, "llvm.loop.unroll.count"),
+                    ConstantAsMetadata::get(Builder.getInt32(unrollCount))}));
+    if (LoopMD.size() > 1) {
+        MDNode *LoopID = MDNode::getDistinct(Context, LoopMD);
+        LoopID->replaceOperandWith(0, LoopID);
+        Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+    }
+
+    ParentFunc->getBasicBlockList().push_back(ExitBB);
+    Builder.SetInsertPoint(ExitBB);
+    PHINode *PN = Builder.CreatePHI(AccTy, 2, "fortmp");
+    PN->addIncoming(Zero, GuardBB);
+    PN->addIncoming(Sum, LatchBB);
+    return PN;
+}
+
+// createEntryBlockAlloca - varの変数の置き場所を関数のentryブロックの先頭に作る。
+// entryブロックにallocaを置いておけば、関数のcodegenの最後のmem2reg(promoteAllocas)で
+// 全てレジスタ(SSAの値とphi)に置き換えられる。
+static AllocaInst *createEntryBlockAlloca(Function *F, Type *Ty, StringRef Name) {
+    IRBuilder<> TmpB(&F->getEntryBlock(), F->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, Name);
+}
+
+// LetExprAST::codegen - letの変数は計算した値をそのまま登録するので、同じ式を何度も書く
+// 代わりに一度だけ計算される(-O0でも)。varの変数はallocaに置き、読み書きはload/storeになる。
+Value *LetExprAST::codegen() {
+    VarScope Scope(NamedValues);
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    for (const LetBinding &binding : bindings) {
+        // 値を計算してから登録するので、`let x = x + 1`の右辺のxは外側のx。
+        Value *InitV = binding.init->codegen();
+        if (!InitV)
+            return nullptr;
+        NumType varType = binding.init->type;
+        if (isMutable) {
+            AllocaInst *Alloca = createEntryBlockAlloca(ParentFunc, InitV->getType(),
+                    Symbols.getName(binding.name));
+            Builder.CreateStore(InitV, Alloca);
+            InitV = Alloca;
+        }
+        NamedValues.insert(binding.name, {InitV, varType, nullptr});
+    }
+    return Body->codegen();
+}
+
+Value *AssignExprAST::codegen() {
+    Value *Alloca = NamedValues.lookup(varName).value;
+    if (!Alloca || !isa<AllocaInst>(Alloca))
+        return LogErrorV("Unknown variable name");
+    Value *V = StoreValue->codegen();
+    if (!V)
+        return nullptr;
+    Builder.CreateStore(V, Alloca);
+    return V;
+}
+
+Value *SeqExprAST::codegen() {
+    Value *V = nullptr;
+    for (ExprAST *E : Exprs) {
+        V = E->codegen();
+        if (!V)
+            return nullptr;
+    }
+    return V;
+}
+
 //===----------------------------------------------------------------------===//
 // MC コンパイラエントリーポイント
 // mc.cppでMainLoop()が呼ばれます。MainLoopは各top level expressionに対して
 // HandleTopLevelExpressionを呼び、その中でASTを作り再帰的にcodegenをしています。
 //===----------------------------------------------------------------------===//
 
-static std::string streamstr;
-static llvm::raw_string_ostream stream(streamstr);
+// Forward declaration (jit.hで定義)
+static void AddModuleToJIT();
+// Forward declaration (cache.hで定義)
+static void AddModuleToCache(FunctionAST &FnAST);
+static void RunTopLevelExpr(const std::string &Name, NumType type);
+
+static void InitializeModule() {
+    myModule = llvm::make_unique<Module>("my cool jit", Context);
+}
+
+static thread_local std::string streamstr;
+static thread_local llvm::raw_string_ostream stream(streamstr);
 static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
+    FunctionAST *FnAST;
+    {
+        TimePhase T(ParseTimer);
+        FnAST = ParseDefinition();
+    }
+    if (FnAST) {
         if (auto *FnIR = FnAST->codegen()) {
             FnIR->print(stream);
+            // 後で定数評価に使うのでASTを取っておく。
+            FunctionDefs[FnAST->getProto().getName()] = FnAST;
+            // JITの場合は定義毎にModuleをJITに渡し、新しいModuleを作る。
+            // オブジェクトキャッシュを使う場合も、定義毎に別のModuleにする。
+            if (Mode != RUN_OBJECT)
+                AddModuleToJIT();
+            else if (!CacheDir.empty())
+                AddModuleToCache(*FnAST);
+        } else {
+            // codegenで弾かれた定義のシグネチャが残っていると、後の呼び出しが意味解析を
+            // 通ってしまい、getFunctionが定義の無い宣言を作ってしまう。
+            FnAST->restorePrototype();
         }
     } else {
         getNextToken();
     }
 }
 
+// 複数のファイルを一つのオブジェクトにまとめる場合(driver.h)、各ファイルの__anon_exprNが
+// 衝突しないよう、top level expressionはファイルの中だけの関数(internal)にする。
+static bool InternalTopLevelExprs = false;
+
 // その名の通りtop level expressionをcodegenします。例えば、「2+1;3+3;」というファイルが
 // 入力だった場合、この関数は最初の「2+1」をcodegenして返ります。(そしてMainLoopからまだ呼び出されます)
 static void HandleTopLevelExpression() {
     // ここでテキストファイルを全てASTにします。
-    if (auto FnAST = ParseTopLevelExpr()) {
+    FunctionAST *FnAST;
+    {
+        TimePhase T(ParseTimer);
+        FnAST = ParseTopLevelExpr();
+    }
+    if (FnAST) {
         // できたASTをcodegenします。
         if (auto *FnIR = FnAST->codegen()) {
             streamstr = "";
             FnIR->print(stream);
+            // JITの場合はその場で実行して値を表示します。
+            if (Mode != RUN_OBJECT) {
+                std::string Name = FnIR->getName().str();
+                NumType type = FnAST->getProto().getType();
+                AddModuleToJIT();
+                RunTopLevelExpr(Name, type);
+            } else {
+                if (InternalTopLevelExprs)
+                    FnIR->setLinkage(GlobalValue::InternalLinkage);
+                if (!CacheDir.empty())
+                    AddModuleToCache(*FnAST);
+            }
+        } else {
+            FnAST->restorePrototype();
         }
     } else {
         // エラー
@@ -404,12 +1371,18 @@ static void HandleTopLevelExpression() {
 }
 
 static void MainLoop() {
-    myModule = llvm::make_unique<Module>("my cool jit", Context);
+    InitializeModule();
+    // 最初のトークンを読む前のプロンプトはmain(mc.cpp)が表示している。
+    bool firstPrompt = true;
     while (true) {
+        if (Mode == RUN_REPL && !firstPrompt)
+            fprintf(stderr, "ready> ");
+        firstPrompt = false;
         switch (CurTok) {
             case tok_eof:
                 // ここで最終的なLLVM IRをプリントしています。
-                fprintf(stderr, "%s", stream.str().c_str());
+                if (Mode == RUN_OBJECT)
+                    diags() << stream.str();
                 return;
             case tok_def:
                 HandleDefinition();
@@ -0,0 +1,565 @@
+//===----------------------------------------------------------------------===//
+// Constant evaluation
+// 引数が全て定数の関数呼び出し(例えばtop levelの`fib(30)`)を、コンパイル時にASTを
+// 解釈して計算し、結果のNumberASTに置き換える。MCの関数は全て副作用が無いので、
+// 同じ引数なら実行時に呼んでも結果は同じになる。
+//
+// 評価は実行時と全く同じ結果になるよう、codegen.hの各codegenと同じ意味で計算する
+// (intの比較はunsigned、比較結果はboolでintValが1/0、&&と||は左辺で決まれば右辺を評価しない等)。
+// 畳み込みは意味解析(sema.h)の後に行うので、評価するASTは全てのノードの型が決まっていて
+// 型エラーが無い。0除算等の実行時に未定義になる計算は評価せず、codegenに任せる。
+// 浮動小数点数の演算は、fpfast等の関数でも書いた通りの順番で評価する(それらのモードでは
+// 実行時の結果も並べ替えた結果も許される)。
+//
+// 無限再帰や巨大な計算でコンパイルが終わらないのを防ぐため、評価するノード数
+// (ConstEvalStepLimit)と関数呼び出しの深さ(ConstEvalDepthLimit)に上限があり、
+// 超えた場合は警告を出して実行時の呼び出しのまま残す。ノード数の上限は一つの定義の
+// 畳み込み全体で共有する。上限を超えた呼び出し(関数と引数)は覚えておき、他の場所で
+// 同じ呼び出しがあっても評価し直さない。警告は関数毎に一度だけ出す。
+//===----------------------------------------------------------------------===//
+
+// ConstValue - コンパイル時に計算した値
+struct ConstValue {
+    NumType type;
+    int64_t intVal;
+    double doubleVal;
+};
+
+// 定義済みの関数のAST。定数評価で関数のbodyを解釈するのに使う。
+static thread_local DenseMap<Symbol, FunctionAST *> FunctionDefs;
+
+// 関数の呼び出しのキー。引数はビット列にして比べる(doubleの-0.0とNaNも区別する)。
+// 関数を定義し直した場合に古い結果を使わないよう、名前ではなくASTで区別する。
+typedef std::pair<const FunctionAST *, std::vector<uint64_t>> ConstCallKey;
+// 上限を超えて評価を諦めた呼び出しと、超えた上限の説明
+static thread_local std::map<ConstCallKey, std::string> ConstEvalGaveUp;
+// 上限を超えた警告を出した関数
+static thread_local std::set<Symbol> ConstEvalWarned;
+
+class ConstEvaluator {
+    public:
+        // run - Eの値を計算する。評価したノード数はこのConstEvaluatorで積算し、
+        // 既に上限に達していれば(警告は出さずに)評価しない。
+        bool run(ExprAST *E, ConstValue &result) {
+            if (steps >= ConstEvalStepLimit)
+                return false;
+            outermostCallee = EmptySymbol;
+            exceeded = false;
+            return E->evaluate(*this, result);
+        }
+
+        // 評価したノード数を数え、上限を超えたらfalseを返す。
+        bool step() {
+            if (++steps <= ConstEvalStepLimit)
+                return true;
+            reportExceeded("step budget (" + std::to_string(ConstEvalStepLimit) + " steps)");
+            return false;
+        }
+
+        // 関数calleeを引数argsで呼び出した値を計算する。
+        bool call(Symbol callee, const std::vector<ConstValue> &args,
+                ConstValue &result) {
+            auto FI = FunctionDefs.find(callee);
+            if (FI == FunctionDefs.end())
+                return false;
+            const PrototypeAST &proto = FI->second->getProto();
+            ArrayRef<ArgTuple> params = proto.getArgs();
+            if (params.size() != args.size())
+                return false;
+
+            ConstCallKey key(FI->second, std::vector<uint64_t>());
+            for (const ConstValue &arg : args) {
+                uint64_t bits;
+                if (arg.type == DOUBLE)
+                    memcpy(&bits, &arg.doubleVal, sizeof(bits));
+                else
+                    bits = arg.intVal;
+                key.second.push_back(bits);
+            }
+
+            // 以前に上限を超えた呼び出しは評価しない。
+            bool outermost = depth == 0;
+            if (outermost)
+                outermostCallee = callee;
+            auto GI = ConstEvalGaveUp.find(key);
+            if (GI != ConstEvalGaveUp.end()) {
+                reportExceeded(GI->second);
+                return false;
+            }
+            if (depth >= ConstEvalDepthLimit) {
+                reportExceeded("depth budget (" + std::to_string(ConstEvalDepthLimit) +
+                        " nested calls)");
+                return false;
+            }
+
+            for (size_t i = 0; i < params.size(); i++) {
+                if (params[i].type != args[i].type)
+                    return false;
+            }
+
+            // memoが付いた関数は評価時にも結果を覚えておく。
+            bool memo = proto.hasAttribute(ATTR_MEMO);
+            if (memo) {
+                auto MI = memoTable.find(key);
+                if (MI != memoTable.end()) {
+                    result = MI->second;
+                    return true;
+                }
+            }
+
+            // 呼び出し先からは呼び出し元のループ変数は見えない。
+            ArrayRef<ArgTuple> savedParams = envParams;
+            const std::vector<ConstValue> *savedArgs = envArgs;
+            std::vector<std::pair<Symbol, ConstValue>> savedLocals;
+            savedLocals.swap(locals);
+            // 自分自身への末尾呼び出し(tailCall)は、codegenと同じくループにする。
+            // 呼び出しを入れ子にしないので、深さの上限には数えない。
+            std::vector<ConstValue> curArgs = args;
+            envParams = params;
+            envArgs = &curArgs;
+            depth++;
+            bool ok;
+            while ((ok = FI->second->getBody().evaluate(*this, result)) && pendingTailCall) {
+                pendingTailCall = false;
+                curArgs.swap(tailArgs);
+            }
+            pendingTailCall = false;
+            depth--;
+            envParams = savedParams;
+            envArgs = savedArgs;
+            locals.swap(savedLocals);
+
+            if (outermost && exceeded)
+                ConstEvalGaveUp[key] = exceededWhat;
+            if (!ok || result.type != proto.getType())
+                return false;
+            if (memo)
+                memoTable[key] = result;
+            return true;
+        }
+
+        // tailCall - 評価中の関数の自分自身への末尾呼び出し。引数を覚えておき、
+        // bodyの評価を終えた後でcallが引数を束縛し直してもう一度bodyを評価する。
+        bool tailCall(std::vector<ConstValue> &args) {
+            tailArgs.swap(args);
+            pendingTailCall = true;
+            return true;
+        }
+
+        // 変数の値を探す。内側のループ変数から順に、最後に関数の引数を探す。
+        // 変数は高々数個なので、mapを作らずに線形探索する。
+        bool lookup(Symbol name, ConstValue &result) {
+            for (auto I = locals.rbegin(), E = locals.rend(); I != E; ++I) {
+                if (I->first == name) {
+                    result = I->second;
+                    return true;
+                }
+            }
+            if (!envArgs)
+                return false;
+            for (size_t i = 0; i < envParams.size(); i++) {
+                if (envParams[i].name == name) {
+                    result = (*envArgs)[i];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // ループ変数やletの変数のスコープ。setLocalは一番内側の変数の値を変える。
+        void pushLocal(Symbol name, const ConstValue &value) { locals.push_back({name, value}); }
+        void setLocal(const ConstValue &value) { locals.back().second = value; }
+        void popLocal() { locals.pop_back(); }
+
+        // assign - varの変数nameに代入する(同じ名前の変数が複数あれば一番内側)。
+        bool assign(Symbol name, const ConstValue &value) {
+            for (auto I = locals.rbegin(), E = locals.rend(); I != E; ++I) {
+                if (I->first == name) {
+                    I->second = value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        uint64_t steps = 0;
+        unsigned depth = 0;
+        bool exceeded = false;
+        std::string exceededWhat;
+        Symbol outermostCallee = EmptySymbol;
+        // 評価中の関数の引数の名前と値
+        ArrayRef<ArgTuple> envParams;
+        const std::vector<ConstValue> *envArgs = nullptr;
+        // 評価中のループ変数とletの変数の名前と値
+        std::vector<std::pair<Symbol, ConstValue>> locals;
+        // tailCallで渡された次の引数
+        std::vector<ConstValue> tailArgs;
+        bool pendingTailCall = false;
+        std::map<ConstCallKey, ConstValue> memoTable;
+
+        void reportExceeded(const std::string &what) {
+            if (exceeded)
+                return;
+            exceeded = true;
+            exceededWhat = what;
+            if (outermostCallee != EmptySymbol && !ConstEvalWarned.insert(outermostCallee).second)
+                return;
+            std::string target = outermostCallee == EmptySymbol ? "expression" :
+                "call to '" + Symbols.getName(outermostCallee).str() + "'";
+            LogWarning("constant evaluation of " + target + " exceeded the " + what +
+                    "; it is left to be computed at runtime");
+        }
+};
+
+bool NumberAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    result.type = type;
+    result.intVal = intVal;
+    result.doubleVal = doubleVal;
+    return ev.step();
+}
+
+bool VariableExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    return ev.step() && ev.lookup(variableName, result);
+}
+
+bool BinaryAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    ConstValue L, R;
+    if (!ev.step() || !LHS->evaluate(ev, L))
+        return false;
+    // &&と||は、左辺で結果が決まれば右辺を評価しない(codegenと同じく、右辺が0除算等でも良い)。
+    // 右辺の型はsemaが決めたものを見て、boolでなければ畳み込まない。
+    if (isLogical(Op) && L.type == BOOL && RHS->type == BOOL &&
+            (L.intVal != 0) == (Op == BinOp::Or)) {
+        result = L;
+        return true;
+    }
+    if (!RHS->evaluate(ev, R))
+        return false;
+    // intとdoubleの演算等はsemaでエラーになるので評価しない。
+    if (L.type != R.type)
+        return false;
+
+    // 比較の結果はboolで、intValが1か0
+    result.type = isComparison(Op) ? BOOL : L.type;
+    result.intVal = 0;
+    if (L.type == BOOL) {
+        switch (Op) {
+            case BinOp::And:
+            case BinOp::Or:
+                // 左辺で決まらなかったので、右辺が結果になる。
+                result.intVal = R.intVal;
+                return true;
+            case BinOp::EQ:
+                result.intVal = L.intVal == R.intVal;
+                return true;
+            case BinOp::NE:
+                result.intVal = L.intVal != R.intVal;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    if (L.type == DOUBLE) {
+        double l = L.doubleVal, r = R.doubleVal;
+        // 比較はunordered(どちらかがNaNなら真)
+        bool cmp;
+        switch (Op) {
+            case BinOp::Add:
+                result.doubleVal = l + r;
+                return true;
+            case BinOp::Sub:
+                result.doubleVal = l - r;
+                return true;
+            case BinOp::Mul:
+                result.doubleVal = l * r;
+                return true;
+            case BinOp::Div:
+                result.doubleVal = l / r;
+                return true;
+            case BinOp::LT:
+                cmp = !(l >= r);
+                break;
+            case BinOp::GT:
+                cmp = !(l <= r);
+                break;
+            case BinOp::LE:
+                cmp = !(l > r);
+                break;
+            case BinOp::GE:
+                cmp = !(l < r);
+                break;
+            case BinOp::EQ:
+                cmp = !(l < r) && !(l > r);
+                break;
+            case BinOp::NE:
+                cmp = !(l == r);
+                break;
+            default:
+                return false;
+        }
+        result.intVal = cmp;
+        return true;
+    }
+
+    // intの四則演算は2の補数でwrap around、比較はunsigned
+    uint64_t l = L.intVal, r = R.intVal;
+    bool cmp;
+    switch (Op) {
+        case BinOp::Add:
+            result.intVal = (int64_t)(l + r);
+            return true;
+        case BinOp::Sub:
+            result.intVal = (int64_t)(l - r);
+            return true;
+        case BinOp::Mul:
+            result.intVal = (int64_t)(l * r);
+            return true;
+        case BinOp::Div:
+            // 0除算とオーバーフローする除算は実行時に未定義なので評価しない。
+            if (R.intVal == 0 || (L.intVal == INT64_MIN && R.intVal == -1))
+                return false;
+            result.intVal = L.intVal / R.intVal;
+            return true;
+        case BinOp::LT:
+            cmp = l < r;
+            break;
+        case BinOp::GT:
+            cmp = l > r;
+            break;
+        case BinOp::LE:
+            cmp = l <= r;
+            break;
+        case BinOp::GE:
+            cmp = l >= r;
+            break;
+        case BinOp::EQ:
+            cmp = l == r;
+            break;
+        case BinOp::NE:
+            cmp = l != r;
+            break;
+        default:
+            return false;
+    }
+    result.intVal = cmp;
+    return true;
+}
+
+bool NotExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    if (!ev.step() || !Operand->evaluate(ev, result) || result.type != BOOL)
+        return false;
+    result.intVal = !result.intVal;
+    return true;
+}
+
+bool CallExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    if (!ev.step())
+        return false;
+    std::vector<ConstValue> args(ArgList.size());
+    for (size_t i = 0; i < ArgList.size(); i++) {
+        if (!ArgList[i]->evaluate(ev, args[i]))
+            return false;
+    }
+    // ループにする末尾呼び出しは、if, let, ;を通ってbodyの値になるので、
+    // ここで値を返さなくても誰も見ない。
+    if (isSelfTailCall)
+        return ev.tailCall(args);
+    return ev.call(callee, args, result);
+}
+
+bool IfExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    ConstValue C;
+    if (!ev.step() || !Cond->evaluate(ev, C))
+        return false;
+    bool cond = C.type == DOUBLE ? C.doubleVal != 0.0 : C.intVal != 0;
+    return cond ? Then->evaluate(ev, result) : Else->evaluate(ev, result);
+}
+
+bool ForExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    ConstValue S, E, T;
+    if (!ev.step() || !Start->evaluate(ev, S) || !End->evaluate(ev, E))
+        return false;
+    if (Step) {
+        if (!Step->evaluate(ev, T))
+            return false;
+    } else {
+        T.type = S.type;
+        T.intVal = 1;
+        T.doubleVal = 1.0;
+    }
+    if (E.type != S.type || T.type != S.type)
+        return false;
+
+    // codegenと同じく、intの比較はsignedで、合計は2の補数でwrap aroundする。
+    // doubleの比較はordered(NaNなら偽)。stepが0やNaNなら一度も回らない。
+    bool ascending = T.type == INT ? T.intVal > 0 : T.doubleVal > 0.0;
+    bool descending = T.type == INT ? T.intVal < 0 : T.doubleVal < 0.0;
+    auto inRange = [&](const ConstValue &i) {
+        if (i.type == INT)
+            return (ascending && i.intVal < E.intVal) || (descending && i.intVal > E.intVal);
+        return (ascending && i.doubleVal < E.doubleVal) ||
+            (descending && i.doubleVal > E.doubleVal);
+    };
+
+    result.type = type;
+    result.intVal = 0;
+    result.doubleVal = 0.0;
+    ConstValue i = S;
+    ev.pushLocal(varName, i);
+    bool ok = true;
+    while (inRange(i)) {
+        ConstValue V;
+        if (!ev.step() || !Body->evaluate(ev, V) || V.type != type) {
+            ok = false;
+            break;
+        }
+        if (type == INT)
+            result.intVal = (int64_t)((uint64_t)result.intVal + (uint64_t)V.intVal);
+        else
+            result.doubleVal += V.doubleVal;
+        if (i.type == INT)
+            i.intVal = (int64_t)((uint64_t)i.intVal + (uint64_t)T.intVal);
+        else
+            i.doubleVal += T.doubleVal;
+        ev.setLocal(i);
+    }
+    ev.popLocal();
+    return ok;
+}
+
+bool LetExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    if (!ev.step())
+        return false;
+    size_t numPushed = 0;
+    bool ok = true;
+    for (const LetBinding &binding : bindings) {
+        ConstValue V;
+        if (!binding.init->evaluate(ev, V)) {
+            ok = false;
+            break;
+        }
+        ev.pushLocal(binding.name, V);
+        numPushed++;
+    }
+    ok = ok && Body->evaluate(ev, result);
+    for (size_t i = 0; i < numPushed; i++)
+        ev.popLocal();
+    return ok;
+}
+
+bool AssignExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    return ev.step() && StoreValue->evaluate(ev, result) && ev.assign(varName, result);
+}
+
+bool SeqExprAST::evaluate(ConstEvaluator &ev, ConstValue &result) {
+    if (!ev.step())
+        return false;
+    for (ExprAST *E : Exprs) {
+        if (!E->evaluate(ev, result))
+            return false;
+    }
+    return true;
+}
+
+// 畳み込み中の定義の評価器(foldFunctionBodyが作る)
+static thread_local ConstEvaluator *FoldEvaluator = nullptr;
+
+// foldExpr - Eの子ノードを畳み込んだ後、E自身をコンパイル時に計算できれば
+// NumberASTに置き換える。Eが定数になった場合にtrueを返す。
+static bool foldExpr(ExprAST *&E) {
+    if (!E->foldConstants())
+        return false;
+    if (E->isNumber())
+        return true;
+
+    ConstValue value;
+    if (!FoldEvaluator->run(E, value))
+        return false;
+    if (value.type == INT)
+        E = ASTCtx.create<NumberAST>(value.intVal);
+    else if (value.type == BOOL)
+        E = ASTCtx.create<NumberAST>(value.intVal != 0);
+    else
+        E = ASTCtx.create<NumberAST>(value.doubleVal);
+    return true;
+}
+
+// foldFunctionBody - 関数のbodyを畳み込む。bodyの中の全ての式で評価の上限を共有する。
+static void foldFunctionBody(ExprAST *&body) {
+    ConstEvaluator ev;
+    FoldEvaluator = &ev;
+    foldExpr(body);
+    FoldEvaluator = nullptr;
+}
+
+bool BinaryAST::foldConstants() {
+    bool l = foldExpr(LHS);
+    bool r = foldExpr(RHS);
+    return l && r;
+}
+
+bool NotExprAST::foldConstants() {
+    return foldExpr(Operand);
+}
+
+bool CallExprAST::foldConstants() {
+    bool allConstant = true;
+    for (ExprAST *&arg : ArgList)
+        allConstant &= foldExpr(arg);
+    return allConstant;
+}
+
+bool IfExprAST::foldConstants() {
+    bool c = foldExpr(Cond);
+    bool t = foldExpr(Then);
+    bool e = foldExpr(Else);
+    return c && t && e;
+}
+
+bool ForExprAST::foldConstants() {
+    // bodyの中でループ変数を使う部分は、ループの外では計算できないので畳み込まれない。
+    bool s = foldExpr(Start);
+    bool e = foldExpr(End);
+    bool t = !Step || foldExpr(Step);
+    if (Step && Step->isNumber() && static_cast<NumberAST *>(Step)->isZero())
+        LogWarning("the step of the for loop is 0, so its body never runs");
+    bool b = foldExpr(Body);
+    return s && e && t && b;
+}
+
+bool LetExprAST::foldConstants() {
+    // bodyの中で変数を使う部分は畳み込まれない。
+    bool allConstant = true;
+    for (LetBinding &binding : bindings)
+        allConstant &= foldExpr(binding.init);
+    return foldExpr(Body) && allConstant;
+}
+
+// 代入は変数を変えるので、値が定数でも代入自体は残す。
+bool AssignExprAST::foldConstants() {
+    foldExpr(StoreValue);
+    return false;
+}
+
+bool SeqExprAST::foldConstants() {
+    bool allConstant = true;
+    for (ExprAST *&E : Exprs)
+        allConstant &= foldExpr(E);
+    return allConstant;
+}
+
+// 配列の要素は実行時にしか分からないので、IndexExprASTとlenは定数にならない。
+bool IndexExprAST::foldConstants() {
+    foldExpr(Index);
+    if (StoreValue)
+        foldExpr(StoreValue);
+    return false;
+}
+
+bool BuiltinCallAST::foldConstants() {
+    for (ExprAST *&arg : ArgList)
+        foldExpr(arg);
+    return false;
+}
@@ -0,0 +1,12 @@
+//===----------------------------------------------------------------------===//
+// Diagnostics
+// エラーや警告はerrs()に直接書かずにdiags()に書く。複数のファイルを並列に
+// コンパイルする場合、各ジョブはDiagStreamを自分のバッファに向けておき、
+// 終わった後にドライバーがファイルの順にまとめて表示する。
+// こうすることで、別々のファイルのエラーが混ざって表示されることがない。
+//===----------------------------------------------------------------------===//
+
+// 今のスレッドの診断メッセージの出力先。nullptrの場合はerrs()に書く。
+static thread_local raw_ostream *DiagStream = nullptr;
+
+static raw_ostream &diags() { return DiagStream ? *DiagStream : errs(); }
@@ -0,0 +1,234 @@
+//===----------------------------------------------------------------------===//
+// Compilation driver
+// 入力ファイル毎にCompileJobを作り、max(-j, 1)個のスレッドで並列にオブジェクトファイル
+// にする。lexer, parser, codegenの状態はthread_localなので、各スレッドは自分の状態で
+// ジョブを一つずつ処理する(ジョブの最初にresetCompilationで前のジョブの状態を消す)。
+//
+// 複数のファイルをコンパイルする場合、診断メッセージはジョブ毎にバッファに溜め、
+// 全てのジョブが終わった後に入力の順に表示する。
+//===----------------------------------------------------------------------===//
+
+// CompileJob - 一つの入力ファイルのコンパイル
+struct CompileJob {
+    std::string input;
+    std::string output;
+    std::string diagnostics;
+    double seconds = 0;
+    bool ok = false;
+};
+
+// resetCompilation - 前のジョブがこのスレッドに残した状態を消す。
+// myModuleはMainLoopが、CurTokはgetNextTokenが新しくする。
+static void resetCompilation() {
+    CacheUnits.clear();
+    FunctionDefs.clear();
+    ConstEvalGaveUp.clear();
+    ConstEvalWarned.clear();
+    FunctionProtos.clear();
+    PureFunctions.clear();
+    CurTailRec = nullptr;
+    streamstr.clear();
+    AnonExprCount = 0;
+    ASTCtx.reset();
+    Symbols.clear();
+    Stats = CompileStats();
+}
+
+// getPeakRSS - このプロセスがこれまでに使った最大のメモリ(KB)
+static uint64_t getPeakRSS() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// printStatsText - --statsの結果を表示する。
+static void printStatsText(raw_ostream &OS, uint64_t objectBytes) {
+    OS << "Statistics:\n";
+    OS << "  tokens:            " << Stats.tokens << "\n";
+    OS << "  functions:         " << Stats.functions << "\n";
+    OS << "  IR instructions:   " << Stats.irInstructions << "\n";
+    OS << "  object bytes:      " << objectBytes << "\n";
+    OS << "  peak RSS:          " << getPeakRSS() << " KB\n";
+    OS << "AST nodes:\n";
+    for (int kind = 0; kind < NUM_NODE_KINDS; kind++)
+        OS << "  " << left_justify(ASTNodeKindNames[kind] + std::string(":"), 19)
+            << ASTCtx.getNumNodes((ASTNodeKind)kind) << "\n";
+    ASTCtx.printStats(OS);
+    if (!CacheDir.empty()) {
+        OS << "Object cache:\n";
+        OS << "  hits:              " << Stats.cacheHits << "\n";
+        OS << "  misses:            " << Stats.cacheMisses << "\n";
+    }
+}
+
+// getStatsJSON - --stats=jsonで表示する値
+static json::Object getStatsJSON(uint64_t objectBytes) {
+    json::Object nodes;
+    for (int kind = 0; kind < NUM_NODE_KINDS; kind++)
+        nodes[ASTNodeKindNames[kind]] = (int64_t)ASTCtx.getNumNodes((ASTNodeKind)kind);
+    json::Object stats{
+        {"tokens", (int64_t)Stats.tokens},
+        {"functions", (int64_t)Stats.functions},
+        {"ir_instructions", (int64_t)Stats.irInstructions},
+        {"object_bytes", (int64_t)objectBytes},
+        {"peak_rss_kb", (int64_t)getPeakRSS()},
+        {"ast_nodes", std::move(nodes)},
+        {"ast_arena_bytes", (int64_t)ASTCtx.getBytesAllocated()},
+    };
+    if (!CacheDir.empty()) {
+        stats["cache_hits"] = (int64_t)Stats.cacheHits;
+        stats["cache_misses"] = (int64_t)Stats.cacheMisses;
+    }
+    return stats;
+}
+
+// printReport - --time-reportと--statsの結果をdiags()に表示する。
+// JSONの場合は{"file": ..., "time": {...}, "stats": {...}}を一つ出力する。
+// timeのキーは"<グループ>.<タイマー>.wall"等で、LLVMの-stats-jsonと同じ形になる。
+static void printReport(StringRef input, uint64_t objectBytes) {
+    raw_ostream &OS = diags();
+    if (ReportJSON) {
+        OS << "{\"file\": " << json::Value(input.str());
+        if (TimeReport) {
+            OS << ", \"time\": {";
+            // パスの時間を測った(一つのスレッドで動いている)場合は、パスのグループも含めて出力する。
+            if (PassTimes) {
+                TimerGroup::printAllJSONValues(OS, "\n");
+                TimerGroup::clearAll();
+            } else {
+                PhaseTimers.printJSONValues(OS, "\n");
+                PhaseTimers.clear();
+            }
+            OS << "\n}";
+        }
+        if (PrintStats)
+            OS << ", \"stats\": " << json::Value(getStatsJSON(objectBytes));
+        OS << "}\n";
+    } else {
+        if (TimeReport) {
+            PhaseTimers.print(OS);
+            PhaseTimers.clear();
+        }
+        if (PrintStats)
+            printStatsText(OS, objectBytes);
+    }
+
+    // パスの時間の表はLLVMが標準エラー出力に表示する。
+    if (PassTimes) {
+        PassTimes.reset();
+        reportAndResetTimings();
+    }
+}
+
+// compileFile - job.inputをコンパイルしてjob.outputに出力する。
+static void compileFile(CompileJob &job) {
+    auto start = std::chrono::steady_clock::now();
+    resetCompilation();
+    if (TimePassesIsEnabled)
+        PassTimes = llvm::make_unique<TimePassesHandler>(true);
+    if (lexer.initStream(job.input)) {
+        // --time-reportの場合は、先に字句解析だけで一度読み切って時間を測る。
+        if (TimeReport) {
+            TimePhase T(LexTimer);
+            while (lexer.gettok() != tok_eof)
+                ;
+            lexer.initStream(job.input);
+        }
+        getNextToken();
+        MainLoop();
+        job.ok = write_output(job.output);
+        uint64_t objectBytes = 0;
+        if (job.ok)
+            sys::fs::file_size(job.output, objectBytes);
+        if (TimeReport || PrintStats)
+            printReport(job.input, objectBytes);
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    job.seconds = d.count();
+}
+
+// runCompileJobs - jobsをnumThreadsスレッドでコンパイルする。
+static void runCompileJobs(std::vector<CompileJob> &jobs, unsigned numThreads) {
+    std::atomic<unsigned> next(0);
+    auto worker = [&]() {
+        unsigned i;
+        while ((i = next++) < jobs.size()) {
+            raw_string_ostream OS(jobs[i].diagnostics);
+            DiagStream = &OS;
+            compileFile(jobs[i]);
+            DiagStream = nullptr;
+            OS.flush();
+        }
+    };
+    std::vector<std::thread> threads;
+    numThreads = std::min<unsigned>(numThreads, jobs.size());
+    for (unsigned i = 1; i < numThreads; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+// compileFiles - 複数の入力をそれぞれオブジェクトファイルにする。
+// outputが空の場合は入力毎に"<入力の名前>.o"を、そうでなければ全てを`ld -r`で
+// まとめた一つのoutputを出力する。
+static bool compileFiles(const std::vector<std::string> &inputs, const std::string &output,
+        unsigned numThreads) {
+    std::vector<CompileJob> jobs(inputs.size());
+    InternalTopLevelExprs = !output.empty();
+    std::set<std::string> outputs;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        CompileJob &job = jobs[i];
+        job.input = inputs[i];
+        if (output.empty()) {
+            job.output = (sys::path::stem(job.input) + ".o").str();
+            if (!outputs.insert(job.output).second) {
+                errs() << "multiple inputs would be written to " << job.output
+                    << "; use -o to combine them\n";
+                return false;
+            }
+        } else {
+            SmallString<128> Path;
+            if (std::error_code EC = sys::fs::createTemporaryFile("mc-obj", "o", Path)) {
+                errs() << "Could not create temporary file: " << EC.message() << "\n";
+                return false;
+            }
+            job.output = Path.str().str();
+        }
+    }
+
+    runCompileJobs(jobs, numThreads);
+
+    bool ok = true;
+    for (CompileJob &job : jobs) {
+        errs() << job.diagnostics;
+        if (!job.ok) {
+            ok = false;
+            continue;
+        }
+        outs() << "Compiled " << job.input << " in "
+            << format("%.1f", job.seconds * 1000) << " ms\n";
+        if (output.empty())
+            outs() << "Wrote " << job.output << "\n";
+    }
+
+    if (!output.empty()) {
+        // ldのエラーより先にここまでの結果を表示しておく。
+        outs().flush();
+        std::vector<std::string> paths;
+        for (CompileJob &job : jobs)
+            paths.push_back(job.output);
+        if (ok && linkObjectFiles(paths, output))
+            outs() << "Wrote " << output << "\n";
+        else
+            ok = false;
+        for (const std::string &path : paths)
+            sys::fs::remove(path);
+    }
+    return ok;
+}
@@ -1,11 +1,184 @@
-static void write_output(void) {
-    // Initialize the target registry etc.
+// OptLevelに対応するバックエンドの最適化レベルを返す。
+static CodeGenOpt::Level getCodeGenOptLevel() {
+    switch (OptLevel) {
+        case 0:
+            return CodeGenOpt::None;
+        case 1:
+            return CodeGenOpt::Less;
+        case 2:
+            return CodeGenOpt::Default;
+        default:
+            return CodeGenOpt::Aggressive;
+    }
+}
+
+// getPGOOptions - --instrumentと--profile-useに対応するPGOの設定。どちらも無ければNone。
+// PassBuilderはこれに従って、パイプラインの最初の方(インライン展開の前)にカウンタを入れるか、
+// プロファイルを読んで分岐の重み(!prof)と関数の呼び出し回数を付けるパスを追加する。
+static Optional<PGOOptions> getPGOOptions() {
+    if (Instrument)
+        return PGOOptions(InstrumentFile, "", "", PGOOptions::IRInstr);
+    if (!ProfileUseFile.empty())
+        return PGOOptions(ProfileUseFile, "", "", PGOOptions::IRUse);
+    return None;
+}
+
+// optimizeModule - OptLevelに応じたnew pass managerのパイプラインを組み立て、
+// Moduleに対して走らせる。-O0の場合は何もしない。
+// パイプラインの中身はclangの-O1〜-O3と同じで、mem2reg(SROA)、インライン展開、
+// GVNによる共通部分式除去、ループ最適化、末尾再帰除去などが含まれる。
+static void optimizeModule(Module &M, TargetMachine *TM) {
+    if (OptLevel == 0)
+        return;
+
+    // --time-reportの場合はパス毎の時間を測る。
+    PassInstrumentationCallbacks PIC;
+    if (PassTimes)
+        PassTimes->registerCallbacks(PIC);
+    // clangと同じく、ループのベクトル化とSLPベクトル化は-O2以上で行う。
+    // -O1ではllvm.loop.vectorize.enableの付いたループ(for vectorize)だけをベクトル化する。
+    PipelineTuningOptions PTO;
+    PTO.LoopInterleaving = OptLevel >= 2;
+    PTO.LoopVectorization = OptLevel >= 2;
+    PTO.SLPVectorization = OptLevel >= 2;
+    PassBuilder PB(TM, PTO, getPGOOptions(), &PIC);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    // TargetMachine固有の情報(TargetTransformInfo等)を使えるように、
+    // 既定のAliasAnalysisパイプラインを登録してから各AnalysisManagerを繋ぐ。
+    FAM.registerPass([&] { return PB.buildDefaultAAPipeline(); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    PassBuilder::OptimizationLevel Level;
+    switch (OptLevel) {
+        case 1:
+            Level = PassBuilder::OptimizationLevel::O1;
+            break;
+        case 2:
+            Level = PassBuilder::OptimizationLevel::O2;
+            break;
+        default:
+            Level = PassBuilder::OptimizationLevel::O3;
+            break;
+    }
+
+    // ビットコードを出力する場合はリンク時にもう一度最適化されるので、clangの-flto(=thin)と
+    // 同じくリンク前用のパイプラインにする(ループの展開やベクトル化等はリンク時に行う)。
+    ModulePassManager MPM;
+    if (EmitMode == EMIT_THINLTO)
+        MPM = PB.buildThinLTOPreLinkDefaultPipeline(Level);
+    else if (EmitMode == EMIT_BC)
+        MPM = PB.buildLTOPreLinkDefaultPipeline(Level);
+    else
+        MPM = PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+}
+
+// getTargetCPUAndFeatures - -march=の値からTargetMachineに渡すCPU名と
+// feature文字列を決める。"native"ならホストのCPUを問い合わせる。
+static void getTargetCPUAndFeatures(std::string &CPU, std::string &Features) {
+    if (TargetCPU != "native") {
+        CPU = TargetCPU;
+        Features = "";
+        return;
+    }
+
+    CPU = sys::getHostCPUName().str();
+    SubtargetFeatures SF;
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures)) {
+        for (auto &F : HostFeatures)
+            SF.AddFeature(F.first(), F.second);
+    }
+    Features = SF.getString();
+}
+
+// createTargetMachine - -march=等のオプションに従って、TargetTriple向けのTargetMachineを作る。
+static TargetMachine *createTargetMachine(const Target *T, const std::string &TargetTriple) {
+    std::string CPU, Features;
+    getTargetCPUAndFeatures(CPU, Features);
+
+    TargetOptions opt;
+    auto RM = Optional<Reloc::Model>();
+    // ifuncのリゾルバは関数のアドレスを返し、--profile-callsはカウンタのグローバル変数を
+    // 読み書きするので、PIEにリンクできるようPICで出力する。
+    if (MultiVersion || ProfileCalls)
+        RM = Reloc::PIC_;
+    return T->createTargetMachine(TargetTriple, CPU, Features, opt, RM,
+            None, getCodeGenOptLevel());
+}
+
+// emitObject - Mをオブジェクトファイルとしてdestに出力する。
+static bool emitObject(Module &M, TargetMachine *TM, raw_pwrite_stream &dest) {
+    legacy::PassManager pass;
+    auto FileType = TargetMachine::CGFT_ObjectFile;
+
+    if (TM->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
+        diags() << "TheTargetMachine can't emit a file of this type";
+        return false;
+    }
+
+    pass.run(M);
+    return true;
+}
+
+// setTargetAttributes - -march=で指定したCPUを関数の属性にする。ビットコードはリンク時に
+// リンカーのTargetMachineでコード生成されるので、属性が無いとリンカーのデフォルトのCPU向けになる。
+// (--multiversionの複製に付けたtarget-featuresはそのままにする。)
+static void setTargetAttributes(Module &M) {
+    if (TargetCPU == "generic")
+        return;
+    std::string CPU, Features;
+    getTargetCPUAndFeatures(CPU, Features);
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        F.addFnAttr("target-cpu", CPU);
+        if (!Features.empty() && !F.hasFnAttribute("target-features"))
+            F.addFnAttr("target-features", Features);
+    }
+}
+
+// emitBitcode - Mをビットコードとしてdestに出力する。EMIT_THINLTOの場合は、ThinLTOのリンクで
+// 関数のインポート先を決めるためのサマリ(関数の大きさや呼び出し関係)と、リンカーのキャッシュ用の
+// ハッシュを一緒に書く。
+static void emitBitcode(Module &M, raw_ostream &dest) {
+    if (EmitMode == EMIT_BC) {
+        WriteBitcodeToFile(M, dest);
+        return;
+    }
+    ProfileSummaryInfo PSI(M);
+    ModuleSummaryIndex Index = buildModuleSummaryIndex(M, nullptr, &PSI);
+    WriteBitcodeToFile(M, dest, false, &Index, true);
+}
+
+// Forward declaration (helper/parallel.hで定義)
+static bool writeObjectParallel(const Target *T, const std::string &TargetTriple,
+        const std::string &Filename);
+// Forward declaration (cache.hで定義)
+static bool writeObjectCached(const Target *T, const std::string &TargetTriple,
+        const std::string &Filename);
+
+// InitializeTargets - ターゲットを登録する。複数のスレッドから同時に呼ぶと
+// 登録が競合するので、ジョブを始める前にmainから一度だけ呼ぶ。
+static void InitializeTargets() {
     InitializeAllTargetInfos();
     InitializeAllTargets();
     InitializeAllTargetMCs();
     InitializeAllAsmParsers();
     InitializeAllAsmPrinters();
+}
 
+// write_output - myModuleを最適化してオブジェクトファイル(--emit=bc, thinltoならビットコード)
+// Filenameに出力する。
+static bool write_output(const std::string &Filename) {
     auto TargetTriple = sys::getDefaultTargetTriple();
     myModule->setTargetTriple(TargetTriple);
 
@@ -16,39 +189,51 @@ static void write_output(void) {
     // This generally occurs if we've forgotten to initialise the
     // TargetRegistry or we have a bogus target triple.
     if (!Target) {
-        errs() << Error;
-        return;
+        diags() << Error;
+        return false;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
-
-    TargetOptions opt;
-    auto RM = Optional<Reloc::Model>();
-    auto TheTargetMachine =
-        Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+    std::unique_ptr<TargetMachine> TheTargetMachine(createTargetMachine(Target, TargetTriple));
 
     myModule->setDataLayout(TheTargetMachine->createDataLayout());
 
-    auto Filename = "output.o";
-    std::error_code EC;
-    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    // オブジェクトキャッシュを使う場合は、変更のあった関数だけを最適化して出力する。
+    if (!CacheDir.empty()) {
+        TimePhase T(PartitionTimer);
+        return writeObjectCached(Target, TargetTriple, Filename);
+    }
 
-    if (EC) {
-        errs() << "Could not open file: " << EC.message();
-        return;
+    // -jの場合はModuleを分割して、スレッド毎に最適化とオブジェクトの出力をする。
+    // (--multiversionの関数の複製も分割した後にパーティション毎に行う。)
+    if (Jobs > 0) {
+        TimePhase T(PartitionTimer);
+        return writeObjectParallel(Target, TargetTriple, Filename);
     }
 
-    legacy::PassManager pass;
-    auto FileType = TargetMachine::CGFT_ObjectFile;
+    {
+        TimePhase T(OptimizeTimer);
+        if (MultiVersion && !multiversionFunctions(*myModule))
+            return false;
+        if (EmitMode != EMIT_OBJ)
+            setTargetAttributes(*myModule);
 
-    if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-        errs() << "TheTargetMachine can't emit a file of this type";
-        return;
+        // オブジェクトファイルを出力する前にIRレベルの最適化をかける。
+        optimizeModule(*myModule, TheTargetMachine.get());
     }
 
-    pass.run(*myModule);
-    dest.flush();
+    TimePhase T(EmitTimer);
+    std::error_code EC;
+    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
 
-    outs() << "Wrote " << Filename << "\n";
+    if (EC) {
+        diags() << "Could not open file: " << EC.message();
+        return false;
+    }
+
+    if (EmitMode != EMIT_OBJ)
+        emitBitcode(*myModule, dest);
+    else if (!emitObject(*myModule, TheTargetMachine.get(), dest))
+        return false;
+    dest.flush();
+    return true;
 }
@@ -0,0 +1,170 @@
+//===----------------------------------------------------------------------===//
+// Function multiversioning
+// --multiversionを指定すると、外部に公開されている各MC関数を複数のISAレベル向けに
+// 複製し、実行時にCPUを判定して最適な版を選ぶifuncを作る。これにより一つの
+// output.oがAVX2やAVX-512を持つマシンでも持たないマシンでも最速で動く。
+//
+// 関数fooは以下のように変換される。
+//   foo.default    : -march等で指定したベースラインのコード
+//   foo.x86_64_v3  : AVX2/FMA/BMI2等を使うコード
+//   foo.x86_64_v4  : AVX-512を使うコード
+//   foo.resolver   : __cpu_modelを見てどれを使うかを返すリゾルバ
+//   foo            : foo.resolverを使うifunc (C++側からはこれが見える)
+//===----------------------------------------------------------------------===//
+
+// ISALevel - 複製する一つのISAレベルを表す。requiredMaskはlibgcc/compiler-rtの
+// __cpu_model.__cpu_features[0]のビットで、全て立っていればこの版を使える。
+struct ISALevel {
+    const char *suffix;
+    const char *features;
+    unsigned requiredMask;
+};
+
+// __cpu_model.__cpu_features[0]のビット位置(compiler-rtのProcessorFeaturesと同じ)
+enum CPUFeatureBit {
+    FEATURE_POPCNT = 2,
+    FEATURE_SSE3 = 5,
+    FEATURE_SSSE3 = 6,
+    FEATURE_SSE4_1 = 7,
+    FEATURE_SSE4_2 = 8,
+    FEATURE_AVX = 9,
+    FEATURE_AVX2 = 10,
+    FEATURE_FMA = 14,
+    FEATURE_AVX512F = 15,
+    FEATURE_BMI = 16,
+    FEATURE_BMI2 = 17,
+    FEATURE_AVX512VL = 20,
+    FEATURE_AVX512BW = 21,
+    FEATURE_AVX512DQ = 22,
+    FEATURE_AVX512CD = 23
+};
+
+// 版に付ける機能は全てリゾルバで確かめられるものだけにする。x86-64-v3にはF16C, LZCNT,
+// MOVBE等も含まれるが、__cpu_features[0]には無いので使わない(それらを隠した仮想マシン等で
+// 不正な命令にならないように)。
+#define MC_X86_64_V3_FEATURES \
+    "+avx,+avx2,+bmi,+bmi2,+fma,+popcnt,+sse3,+ssse3,+sse4.1,+sse4.2"
+#define MC_X86_64_V3_MASK \
+    ((1u << FEATURE_POPCNT) | (1u << FEATURE_SSE3) | (1u << FEATURE_SSSE3) | \
+     (1u << FEATURE_SSE4_1) | (1u << FEATURE_SSE4_2) | \
+     (1u << FEATURE_AVX) | (1u << FEATURE_AVX2) | (1u << FEATURE_FMA) | \
+     (1u << FEATURE_BMI) | (1u << FEATURE_BMI2))
+
+// リゾルバは先頭から順に試すので、より新しいISAレベルを先に並べる。
+static const ISALevel ISALevels[] = {
+    {"x86_64_v4",
+        MC_X86_64_V3_FEATURES ",+avx512f,+avx512bw,+avx512cd,+avx512dq,+avx512vl",
+        MC_X86_64_V3_MASK | (1u << FEATURE_AVX512F) | (1u << FEATURE_AVX512VL) |
+            (1u << FEATURE_AVX512BW) | (1u << FEATURE_AVX512DQ) |
+            (1u << FEATURE_AVX512CD)},
+    {"x86_64_v3", MC_X86_64_V3_FEATURES, MC_X86_64_V3_MASK},
+};
+
+// createResolver - versions[i]がISALevels[i]に、最後の要素がベースラインに対応する
+// 版の配列を受け取り、実行中のCPUで使える版のアドレスを返すリゾルバ関数を作る。
+static Function *createResolver(Module &M, const std::string &Name,
+        ArrayRef<Function *> versions) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    PointerType *FnPtrTy = versions.back()->getFunctionType()->getPointerTo();
+
+    // libgcc/compiler-rtが提供するCPU判定用のシンボル
+    // struct { unsigned vendor, type, subtype; unsigned features[1]; } __cpu_model;
+    StructType *CPUModelTy = StructType::get(Ctx,
+            {Int32Ty, Int32Ty, Int32Ty, ArrayType::get(Int32Ty, 1)});
+    Constant *CPUModel = M.getOrInsertGlobal("__cpu_model", CPUModelTy);
+    FunctionCallee CPUInit = M.getOrInsertFunction("__cpu_indicator_init",
+            Type::getVoidTy(Ctx));
+
+    Function *Resolver = Function::Create(FunctionType::get(FnPtrTy, false),
+            Function::InternalLinkage, Name + ".resolver", &M);
+    IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Resolver));
+
+    // ifuncのリゾルバはコンストラクタより先に呼ばれるので、自分で初期化する。
+    B.CreateCall(CPUInit);
+    Value *FeaturesPtr = B.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3);
+    FeaturesPtr = B.CreateConstInBoundsGEP2_32(ArrayType::get(Int32Ty, 1),
+            FeaturesPtr, 0, 0);
+    Value *Features = B.CreateLoad(Int32Ty, FeaturesPtr, "cpu_features");
+
+    for (size_t i = 0; i + 1 < versions.size(); i++) {
+        Constant *Mask = ConstantInt::get(Int32Ty, ISALevels[i].requiredMask);
+        Value *Supported = B.CreateICmpEQ(B.CreateAnd(Features, Mask), Mask,
+                std::string("has_") + ISALevels[i].suffix);
+        BasicBlock *RetBB = BasicBlock::Create(Ctx, ISALevels[i].suffix, Resolver);
+        BasicBlock *NextBB = BasicBlock::Create(Ctx, "next", Resolver);
+        B.CreateCondBr(Supported, RetBB, NextBB);
+
+        B.SetInsertPoint(RetBB);
+        B.CreateRet(versions[i]);
+        B.SetInsertPoint(NextBB);
+    }
+    B.CreateRet(versions.back());
+    return Resolver;
+}
+
+// checkMultiversionTarget - --multiversionに対応したターゲットか調べる。
+static bool checkMultiversionTarget(const Triple &TT) {
+    if (TT.getArch() != Triple::x86_64 || !TT.isOSBinFormatELF()) {
+        diags() << "--multiversion is only supported for x86-64 ELF targets\n";
+        return false;
+    }
+    return true;
+}
+
+// multiversionFunctions - Module内の公開関数を全てISAレベル毎に複製し、ifuncに置き換える。
+// 最適化パスより前に呼ぶことで、それぞれの版がそのISA向けにベクトル化等される。
+static bool multiversionFunctions(Module &M) {
+    if (!checkMultiversionTarget(Triple(M.getTargetTriple())))
+        return false;
+
+    // 内部関数(memoのfoo.memo_impl等)も複製するが、ifuncを作るのは公開関数だけ。
+    std::vector<Function *> defined, exported;
+    for (Function &F : M) {
+        if (F.isDeclaration() || F.getName().startswith("__"))
+            continue;
+        defined.push_back(&F);
+        if (F.hasExternalLinkage())
+            exported.push_back(&F);
+    }
+
+    // versions[f]はISALevelsの順に並んだfの各版で、最後はベースライン(元の関数)。
+    std::map<Function *, std::vector<Function *>> versions;
+    for (size_t level = 0; level < array_lengthof(ISALevels); level++) {
+        std::map<Function *, Function *> clones;
+        std::set<Function *> cloneSet;
+        for (Function *F : defined) {
+            ValueToValueMapTy VMap;
+            Function *Clone = CloneFunction(F, VMap);
+            Clone->setName(F->getName() + "." + ISALevels[level].suffix);
+            Clone->setLinkage(GlobalValue::InternalLinkage);
+            Clone->addFnAttr("target-features", ISALevels[level].features);
+            clones[F] = Clone;
+            cloneSet.insert(Clone);
+            versions[F].push_back(Clone);
+        }
+
+        // 同じISAレベルの版同士で呼び合うように呼び出し先を付け替える。
+        for (auto &P : clones) {
+            for (auto UI = P.first->use_begin(); UI != P.first->use_end();) {
+                Use &U = *UI++;
+                auto *I = dyn_cast<Instruction>(U.getUser());
+                if (I && cloneSet.count(I->getFunction()))
+                    U.set(P.second);
+            }
+        }
+    }
+
+    // 元の関数をベースライン版にして、元の名前はifuncに譲る。
+    for (Function *F : exported) {
+        std::string Name = F->getName().str();
+        F->setName(Name + ".default");
+        F->setLinkage(GlobalValue::InternalLinkage);
+        versions[F].push_back(F);
+
+        Function *Resolver = createResolver(M, Name, versions[F]);
+        GlobalIFunc::create(F->getFunctionType(), 0, GlobalValue::ExternalLinkage,
+                Name, Resolver, &M);
+    }
+    return true;
+}
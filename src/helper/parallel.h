@@ -0,0 +1,149 @@
+//===----------------------------------------------------------------------===//
+// Parallel code generation
+// -j Nを指定すると、myModuleをSplitModuleで複数のパーティションに分け、
+// Nスレッドでそれぞれを最適化してオブジェクトコードにする。
+// LLVMContextはスレッドセーフではないので、各パーティションは一度bitcodeにして、
+// スレッド毎のLLVMContextとTargetMachineで読み直してから処理する。
+// 最後に各パーティションのオブジェクトを`ld -r`で一つのoutput.oにまとめる。
+//
+// パーティションの分け方はNではなくModuleの関数の数だけで決まり、まとめる順番も
+// 固定なので、output.oは-jの値に関係なく同じになる。
+//===----------------------------------------------------------------------===//
+
+// パーティションの数の上限。これより多いスレッドを使っても速くならない。
+static const unsigned MaxPartitions = 32;
+
+// Partition - 一つのパーティションの入力(bitcode)と出力(オブジェクト)
+struct Partition {
+    SmallVector<char, 0> bitcode;
+    SmallVector<char, 0> object;
+    std::string error;
+};
+
+// compilePartition - 新しいLLVMContextでパーティションを読み込み、最適化してオブジェクトにする。
+static void compilePartition(const Target *T, const std::string &TargetTriple,
+        Partition &P) {
+    LLVMContext Ctx;
+    auto MOrErr = parseBitcodeFile(
+            MemoryBufferRef(StringRef(P.bitcode.data(), P.bitcode.size()), "partition"), Ctx);
+    if (!MOrErr) {
+        P.error = toString(MOrErr.takeError());
+        return;
+    }
+    std::unique_ptr<Module> M = std::move(*MOrErr);
+    std::unique_ptr<TargetMachine> TM(createTargetMachine(T, TargetTriple));
+
+    // ifuncとそのリゾルバ、各ISAレベルの版はSplitModuleで別々のパーティションに
+    // 分かれてしまうことがあるので、分割した後にパーティション毎に複製する。
+    if (MultiVersion && !multiversionFunctions(*M)) {
+        P.error = "failed to multiversion functions";
+        return;
+    }
+
+    optimizeModule(*M, TM.get());
+
+    raw_svector_ostream dest(P.object);
+    if (!emitObject(*M, TM.get(), dest))
+        P.error = "failed to emit object code";
+}
+
+// linkObjectFiles - pathsのオブジェクトファイルを`ld -r`で一つのFilenameにまとめる。
+static bool linkObjectFiles(const std::vector<std::string> &paths, const std::string &Filename) {
+    auto LD = sys::findProgramByName("ld");
+    if (!LD) {
+        diags() << "could not find 'ld' to combine objects: " << LD.getError().message() << "\n";
+        return false;
+    }
+
+    std::vector<StringRef> args = {"ld", "-r", "-o", Filename};
+    for (const std::string &path : paths)
+        args.push_back(path);
+    std::string ErrMsg;
+    if (sys::ExecuteAndWait(*LD, args, None, {}, 0, 0, &ErrMsg) != 0) {
+        diags() << "ld -r failed" << (ErrMsg.empty() ? "" : ": " + ErrMsg) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// linkObjects - 各パーティションのオブジェクトを`ld -r`でFilenameにまとめる。
+static bool linkObjects(std::vector<Partition> &partitions, const std::string &Filename) {
+    // 一時ファイルに書き出してからリンクし、終わったら消す。
+    std::vector<std::string> paths;
+    bool ok = true;
+    for (Partition &P : partitions) {
+        int FD;
+        SmallString<128> Path;
+        if (std::error_code EC = sys::fs::createTemporaryFile("mc-part", "o", FD, Path)) {
+            diags() << "Could not create temporary file: " << EC.message() << "\n";
+            ok = false;
+            break;
+        }
+        paths.push_back(Path.str().str());
+        raw_fd_ostream OS(FD, true);
+        OS.write(P.object.data(), P.object.size());
+    }
+
+    if (ok)
+        ok = linkObjectFiles(paths, Filename);
+
+    for (const std::string &path : paths)
+        sys::fs::remove(path);
+    return ok;
+}
+
+// compilePartitions - todoの各パーティションをmax(Jobs, 1)スレッドでコンパイルする。
+static bool compilePartitions(const Target *T, const std::string &TargetTriple,
+        std::vector<Partition *> &todo) {
+    // 各スレッドは次のパーティションの番号を取って処理する。
+    std::atomic<unsigned> next(0);
+    auto worker = [&]() {
+        unsigned i;
+        while ((i = next++) < todo.size())
+            compilePartition(T, TargetTriple, *todo[i]);
+    };
+    std::vector<std::thread> threads;
+    unsigned numThreads = std::min<unsigned>(std::max(Jobs, 1u), todo.size());
+    for (unsigned i = 1; i < numThreads; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+
+    for (Partition *P : todo) {
+        if (!P->error.empty()) {
+            diags() << "code generation failed: " << P->error << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writeObjectParallel(const Target *T, const std::string &TargetTriple,
+        const std::string &Filename) {
+    if (MultiVersion && !checkMultiversionTarget(Triple(TargetTriple)))
+        return false;
+
+    unsigned numFunctions = 0;
+    for (Function &F : *myModule) {
+        if (!F.isDeclaration())
+            numFunctions++;
+    }
+    unsigned numPartitions = std::max(1u, std::min(numFunctions, MaxPartitions));
+
+    // 内部関数(memoのfoo.memo_impl等)とそれを参照する関数は同じパーティションに置く。
+    std::vector<Partition> partitions;
+    partitions.reserve(numPartitions);
+    SplitModule(std::move(myModule), numPartitions, [&](std::unique_ptr<Module> MPart) {
+        partitions.emplace_back();
+        raw_svector_ostream OS(partitions.back().bitcode);
+        WriteBitcodeToFile(*MPart, OS);
+    }, /*PreserveLocals=*/true);
+
+    std::vector<Partition *> todo;
+    for (Partition &P : partitions)
+        todo.push_back(&P);
+    if (!compilePartitions(T, TargetTriple, todo))
+        return false;
+    return linkObjects(partitions, Filename);
+}
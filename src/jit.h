@@ -0,0 +1,82 @@
+//===----------------------------------------------------------------------===//
+// JIT
+// --jitと--replでは、output.oを出力する代わりにORC JIT(LLJIT)を使って
+// プロセス内でコンパイルし、top level expressionをその場で実行して値を表示する。
+// 定義やexpressionを一つcodegenする毎にmyModuleをJITに渡し、新しいModuleを作る。
+//===----------------------------------------------------------------------===//
+
+static std::unique_ptr<orc::LLJIT> TheJIT;
+// optimizeModuleに渡すための、JITと同じ設定のTargetMachine
+static std::unique_ptr<TargetMachine> JITTargetMachine;
+
+static void LogJITError(Error Err) {
+    logAllUnhandledErrors(std::move(Err), errs(), "\e[31mJIT Error: \e[m");
+}
+
+// InitializeJIT - ホストCPU向けのLLJITを作る。失敗した場合はfalseを返す。
+static bool InitializeJIT() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+    if (!JTMB) {
+        LogJITError(JTMB.takeError());
+        return false;
+    }
+    JTMB->setCodeGenOptLevel(getCodeGenOptLevel());
+
+    auto TM = JTMB->createTargetMachine();
+    if (!TM) {
+        LogJITError(TM.takeError());
+        return false;
+    }
+    JITTargetMachine = std::move(*TM);
+
+    auto J = orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(*JTMB)).create();
+    if (!J) {
+        LogJITError(J.takeError());
+        return false;
+    }
+    TheJIT = std::move(*J);
+    return true;
+}
+
+// AddModuleToJIT - 現在のmyModuleを最適化してJITに渡し、次の定義用に新しいModuleを作る。
+static void AddModuleToJIT() {
+    myModule->setDataLayout(TheJIT->getDataLayout());
+    optimizeModule(*myModule, JITTargetMachine.get());
+
+    if (auto Err = TheJIT->addIRModule(
+                orc::ThreadSafeModule(std::move(myModule), TSContext)))
+        LogJITError(std::move(Err));
+
+    InitializeModule();
+}
+
+// RunTopLevelExpr - JITに追加済みのtop level expressionの関数を呼び、値を標準出力に表示する。
+static void RunTopLevelExpr(const std::string &Name, NumType type) {
+    // ベクトルを返す関数の呼び出し規約はCPUの機能(AVX等)で変わるので、C++からは呼ばない。
+    if (isVectorType(type)) {
+        LogError(("cannot print a value of type '" + std::string(getTypeName(type)) +
+                    "'; reduce it to a scalar (e.g. with hadd)").c_str());
+        return;
+    }
+
+    auto Sym = TheJIT->lookup(Name);
+    if (!Sym) {
+        LogJITError(Sym.takeError());
+        return;
+    }
+
+    if (type == INT) {
+        auto *FP = (int64_t (*)())(intptr_t)Sym->getAddress();
+        outs() << FP() << "\n";
+    } else if (type == DOUBLE) {
+        auto *FP = (double (*)())(intptr_t)Sym->getAddress();
+        outs() << format("%.17g", FP()) << "\n";
+    } else if (type == BOOL) {
+        auto *FP = (bool (*)())(intptr_t)Sym->getAddress();
+        outs() << (FP() ? "true" : "false") << "\n";
+    }
+    outs().flush();
+}
@@ -19,28 +19,143 @@ enum Token {
     tok_else = -8,
     tok_op = -9,
     tok_int = -10,
-    tok_double = -11
+    tok_double = -11,
+    tok_for = -12,
+    tok_in = -13,
+    tok_let = -14,
+    tok_var = -15,
+    tok_bool = -16,
+    tok_true = -17,
+    tok_false = -18
 };
 
 bool isNumberTok(Token t) {
     return (t == tok_int_number || t == tok_double_number);
 }
 
-std::set<char> op_char{
-    '>',
-    '<',
-    '=',
-    '+',
-    '-',
-    '*',
-    '/',
-    '!'
+// キーワードの表。キーワードは(長さ + 先頭の文字 + 末尾の文字) & 31で引ける完全ハッシュに
+// なっていて、識別子を読んだら一回の比較だけでキーワードかどうかが分かる。
+// ("if"と"in"のように長さと先頭の文字が同じキーワードがあるので、末尾の文字も使う。)
+// キーワードを増やした場合は、static_assertが通るようにハッシュ関数か表を変えること。
+struct Keyword {
+    const char *text;
+    unsigned len;
+    int token;
 };
 
+constexpr unsigned keywordHash(const char *text, unsigned len) {
+    return (len + (unsigned char)text[0] + (unsigned char)text[len - 1]) & 31;
+}
+
+#define NO_KEYWORD {"", 0, tok_identifier}
+static constexpr Keyword Keywords[32] = {
+    {"int", 3, tok_int}, NO_KEYWORD, NO_KEYWORD, {"let", 3, tok_let},
+    NO_KEYWORD, NO_KEYWORD, {"then", 4, tok_then}, NO_KEYWORD,
+    NO_KEYWORD, NO_KEYWORD, NO_KEYWORD, {"var", 3, tok_var},
+    NO_KEYWORD, {"def", 3, tok_def}, {"else", 4, tok_else}, {"double", 6, tok_double},
+    {"false", 5, tok_false}, {"if", 2, tok_if}, {"bool", 4, tok_bool}, NO_KEYWORD,
+    NO_KEYWORD, NO_KEYWORD, NO_KEYWORD, NO_KEYWORD,
+    NO_KEYWORD, {"in", 2, tok_in}, NO_KEYWORD, {"for", 3, tok_for},
+    NO_KEYWORD, {"true", 4, tok_true}, NO_KEYWORD, NO_KEYWORD,
+};
+#undef NO_KEYWORD
+
+// 全てのキーワードが自分のハッシュ値の位置に置かれているか
+constexpr bool isPerfectKeywordTable(unsigned i) {
+    return i == 32 || ((Keywords[i].len == 0 ||
+                keywordHash(Keywords[i].text, Keywords[i].len) == i) &&
+            isPerfectKeywordTable(i + 1));
+}
+static_assert(isPerfectKeywordTable(0), "keyword hash is not perfect for Keywords");
+
+// lookupKeyword - 識別子strがキーワードならそのトークンを、そうでなければtok_identifierを返す。
+static int lookupKeyword(StringRef str) {
+    const Keyword &K = Keywords[keywordHash(str.data(), str.size())];
+    if (K.len == str.size() && memcmp(K.text, str.data(), K.len) == 0)
+        return K.token;
+    return tok_identifier;
+}
+
+// BinOp - 二項演算子
+enum class BinOp : unsigned char {
+    Add, Sub, Mul, Div,
+    LT, GT, LE, GE, EQ, NE,
+    And, Or,
+    Invalid
+};
+
+// 二項演算子の結合度。BinOpの順に並べる。
+// 数字が低いほど結合度が低く、二項演算子でない場合は-1。
+// TODO 3.1: "<"を実装してみよう
+// BinOp::LTの結合度を登録して下さい。
+static constexpr int BinOpPrecedence[] = {
+    30, 30, 40, 40,         // + - * /
+    20, 20, 20, 20, 10, 10, // < > <= >= == !=
+    6, 5,                   // && ||
+    -1
+};
+static_assert(sizeof(BinOpPrecedence) / sizeof(BinOpPrecedence[0]) ==
+        (size_t)BinOp::Invalid + 1, "BinOpPrecedence must cover every BinOp");
+
+constexpr int getPrecedence(BinOp op) {
+    return BinOpPrecedence[(size_t)op];
+}
+static_assert(getPrecedence(BinOp::Mul) > getPrecedence(BinOp::Add) &&
+        getPrecedence(BinOp::Add) > getPrecedence(BinOp::LT) &&
+        getPrecedence(BinOp::LT) > getPrecedence(BinOp::EQ) &&
+        getPrecedence(BinOp::EQ) > getPrecedence(BinOp::And) &&
+        getPrecedence(BinOp::And) > getPrecedence(BinOp::Or),
+        "unexpected operator precedence");
+
+// 比較演算子かどうか。結果はbool(ベクトルの比較なら、要素毎に真なら-1、偽なら0のint)。
+static bool isComparison(BinOp op) {
+    return op >= BinOp::LT && op <= BinOp::NE;
+}
+// 論理演算子(&&, ||)かどうか。右辺は左辺で結果が決まらない時だけ評価する。
+static bool isLogical(BinOp op) {
+    return op == BinOp::And || op == BinOp::Or;
+}
+
+static inline bool isOpChar(char c) {
+    switch (c) {
+        case '>': case '<': case '=': case '+':
+        case '-': case '*': case '/': case '!':
+        case '&': case '|':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// lookupBinOp - 演算子の文字列からBinOpを得る。二項演算子でなければBinOp::Invalid。
+static BinOp lookupBinOp(StringRef op) {
+    if (op.size() == 1) {
+        switch (op[0]) {
+            case '+': return BinOp::Add;
+            case '-': return BinOp::Sub;
+            case '*': return BinOp::Mul;
+            case '/': return BinOp::Div;
+            case '<': return BinOp::LT;
+            case '>': return BinOp::GT;
+        }
+    } else if (op.size() == 2 && op[1] == '=') {
+        switch (op[0]) {
+            case '<': return BinOp::LE;
+            case '>': return BinOp::GE;
+            case '=': return BinOp::EQ;
+            case '!': return BinOp::NE;
+        }
+    } else if (op == "&&") {
+        return BinOp::And;
+    } else if (op == "||") {
+        return BinOp::Or;
+    }
+    return BinOp::Invalid;
+}
+
 class NumberDFA {
     private:
     int state = 1; //初期状態0。状態は0から7まである
-    std::string read_text = "";
     bool isE(int c) {
         return (c == 'E' || c == 'e');
     }
@@ -56,7 +171,6 @@ class NumberDFA {
 
     public:
     bool read(int c) { //一文字読んで遷移に成功したらtrue, 失敗したらfalse
-        read_text += (char)c;
         switch(state) {
             case 1:
                 if (isDot(c)) {
@@ -124,8 +238,10 @@ class NumberDFA {
     bool isDouble() {
         return (state == 4 || state == 7);
     }
-    double getValue() {
-        return strtod(read_text.c_str(), nullptr);
+    // 受理した文字列textの値を返す。
+    // strtodは"0x10"等も読んでしまうので、受理した部分だけをコピーしてから変換する。
+    static double getValue(StringRef text) {
+        return strtod(text.str().c_str(), nullptr);
     }
 };
 
@@ -134,113 +250,89 @@ class Lexer {
         // gettok - トークンが数値だった場合はnumValにその数値をセットした上でtok_number
         // を返し、トークンが識別子だった場合はidentifierStrにその文字をセットした上でtok_identifierを返す。
         // '+'や他のunknown tokenだった場合はそのascii codeを返す。
+        //
+        // ソースは全てメモリ上(大きなファイルはmmap)にあり、curが次に読む文字を指している。
+        // バッファの末尾(end)には必ず'\0'があるので、それを番兵にしてループの中で
+        // 終端チェックをしないようにしている。空白、コメント、識別子の読み飛ばしは
+        // TheScanner(scan.h)がSIMDでまとめて行う。
         int gettok() {
-            static int lastChar = getNextChar(iFile);
+            while (true) {
+                // スペースをスキップ
+                cur = TheScanner->skipSpace(cur);
+
+                // TODO 1.4: コメントアウトを実装してみよう
+                // '#'を読んだら、その行の末尾まで無視をするコメントアウトを実装する。
+                if (*cur == '#') {
+                    // Comment until end of line.
+                    cur = TheScanner->skipLine(cur + 1);
+                    continue;
+                }
 
-            // スペースをスキップ
-            while (isspace(lastChar))
-                lastChar = getNextChar(iFile);
+                // 番兵の'\0'に着いたら、REPLなら次の行を読んで続け、そうでなければEOF。
+                if (*cur == '\0' && cur == end) {
+                    if (refill())
+                        continue;
+                    return tok_eof;
+                }
+                break;
+            }
 
             // TODO 2.1: 識別子をトークナイズする
-            // 1.3と同様に、今読んでいる文字がアルファベットだった場合はアルファベットで
+            // 今読んでいる文字がアルファベットだった場合はアルファベットで
             // なくなるまで読み込み、その値をidentifierStrにセットする。
             // 読み込んだ文字が"def"だった場合は関数定義であるためtok_defをreturnし、
             // そうでなければ引数の参照か関数呼び出しであるためtok_identifierをreturnする。
-            if (isalpha(lastChar)) {
-                identifierStr = lastChar;
-                while (isalnum((lastChar = getNextChar(iFile))))
-                    identifierStr += lastChar;
-
-                if (identifierStr == "def")
-                    return tok_def;
-                if (identifierStr == "if")
-                    return tok_if;
-                if (identifierStr == "then")
-                    return tok_then;
-                if (identifierStr == "else")
-                    return tok_else;
-                if (identifierStr == "int")
-                    return tok_int;
-                if (identifierStr == "double")
-                    return tok_double;
+            // identifierStrはコピーせず、ソースのバッファを直接指す。
+            // キーワードはKeywordsの完全ハッシュで判定し、それ以外はSymbolsに登録する。
+            if (isalpha((unsigned char)*cur)) {
+                const char *start = cur;
+                cur = TheScanner->skipAlnum(cur + 1);
+                identifierStr = StringRef(start, cur - start);
+
                 // TODO 3.2: "if", "then", "else"をトークナイズしてみよう
-                // 上記の"def"の例を参考に、3つの予約語をトークナイズして下さい。
-                return tok_identifier;
+                // "def"の例を参考に、3つの予約語をKeywordsの表に登録して下さい
+                // (表の位置はkeywordHashで決まる)。
+                int tok = lookupKeyword(identifierStr);
+                if (tok == tok_identifier)
+                    identifierSym = Symbols.intern(identifierStr);
+                return tok;
             }
 
             // TODO 1.3: 数字のパーシングを実装してみよう
-            // 今読んでいる文字(lastChar)が数字だった場合(isdigit(lastChar) == true)は、
-            // 数字が終わるまで読み、その数値をnumValにセットする。
-            // 1. lastCharが数字かチェックする e.g. if (isdigit(lastChar)) {..
-            // 2. 数字を格納するための変数を作る e.g. std::string str = "";
-            // 3. 入力が'456'という数字だったとして、今の文字は'4'なので、
-            //    次の文字が数字ではなくなるまで読み込み、2で作った変数に格納する
-            //    e.g. str += lastChar;
-            // 4. 次の文字が数字でなくなるまで読み込む。ファイルから次の文字を読み込むのは、
-            //    getNextChar(iFile)で出来る。 e.g. while(isdigit(lastChar = getNextChar(iFile))) {..
-            // 5. 2と同様に、4が数字であれば2で作った変数に格納する
-            // 6. 次の文字が数字でなくなったら、setnumValを読んでnumValに数値を格納する。その際、
-            //   strtodというcharからintにする関数が利用できる。
-            // 7. このトークンは数値だったので、tok_numberをreturnする。
+            // 今読んでいる文字(*cur)が数字だった場合は、数字が終わるまで読み、その数値を
+            // intValかdoubleValにセットしてtok_int_numberかtok_double_numberを返す。
+            // 読んだ文字列はnumberStrにセットする(コピーせず、ソースのバッファを指す)。
             //
-            // ここに実装して下さい
-
             //doubleのDFAを用いてdouble型数値をパースする
-            if (isdigit(lastChar) || (lastChar=='.')) {
+            if (isdigit((unsigned char)*cur) || (*cur == '.')) {
+                const char *start = cur;
                 NumberDFA dfa;
-                while (dfa.read(lastChar)) { //読み込めなくなるまで読む
-                    lastChar = getNextChar(iFile);
-                }
+                while (dfa.read(*cur)) //読み込めなくなるまで読む
+                    cur++;
                 if (dfa.isAccepted()) { //受理状態か確認
+                    numberStr = StringRef(start, cur - start);
                     if (dfa.isDouble()) {
-                        setDoubleVal(dfa.getValue());
+                        setDoubleVal(NumberDFA::getValue(numberStr));
                         return tok_double_number;
                     } else {
-                        setIntVal((int)dfa.getValue());
+                        setIntVal((int)NumberDFA::getValue(numberStr));
                         return tok_int_number;
                     }
                 }
             }
 
-            // TODO 1.4: コメントアウトを実装してみよう
-            // '#'を読んだら、その行の末尾まで無視をするコメントアウトを実装する。
-            // 1. 今の文字(LastChar)が'#'かどうかをチェック
-            // 2. lastCharに次のトークンを読み込む(getNextChar(iFile)を使う)
-            // 3. lastCharが'\n'か、EOFになるまで読み込む。e.g. while(lastChar != EOF && lastChar != '\n')
-            // 4. lastCharがEOFでない場合、行末まで読み込んだので次のトークンに進むためにgettok()をreturnする。
-            //
-            // ここに実装して下さい
-            if (lastChar == '#') {
-                // Comment until end of line.
-                lastChar = getNextChar(iFile);
-                while (lastChar != EOF && lastChar != '\n')
-                    lastChar = getNextChar(iFile);
-
-                if (lastChar != EOF)
-                    return gettok();
-            }
-
-            // EOFならtok_eofを返す
-            if (iFile.eof())
-                return tok_eof;
-            
             // 演算子ならtok_opを返す
-            if (op_char.count(lastChar) > 0) {
-                std::string op = "";
-                op += lastChar;
-                lastChar = getNextChar(iFile);
-                while(op_char.count(lastChar) > 0) {
-                    op += lastChar;
-                    lastChar = getNextChar(iFile);
-                }
-                setOperand(op);
+            if (isOpChar(*cur)) {
+                const char *start = cur;
+                while (isOpChar(*++cur))
+                    ;
+                setOperand(StringRef(start, cur - start));
+                binOp = lookupBinOp(operandStr);
                 return tok_op;
             }
 
             // tok_numberでもtok_eofでもなければそのcharのasciiを返す
-            int thisChar = lastChar;
-            lastChar = getNextChar(iFile);
-            return thisChar;
+            return (unsigned char)*cur++;
         }
 
         // 数字を格納するnumValのgetter, setter
@@ -250,26 +342,76 @@ class Lexer {
         void setDoubleVal(double val) { doubleVal = val; }
 
         // 識別子を格納するIdentifierStrのgetter, setter
-        std::string getIdentifier() { return identifierStr; }
-        void setIdentifier(std::string str) { identifierStr = str; }
+        // 返すStringRefはソースのバッファを指しているので、次のgettokまでしか使えない。
+        StringRef getIdentifier() { return identifierStr; }
+        void setIdentifier(StringRef str) { identifierStr = str; }
+        // 識別子のSymbol(キーワードの場合は無効)
+        Symbol getSymbol() { return identifierSym; }
+
+        // 数値リテラルの文字列(ソースのバッファを指す)
+        StringRef getNumberStr() { return numberStr; }
+
+        // peekChar - 次のトークンの最初の文字を、読み進めずに返す。
+        // 今のバッファの中だけを見る(REPLで行を跨ぐ場合は'\0'になる)。
+        char peekChar() { return *TheScanner->skipSpace(cur); }
 
         // 演算子を格納するoperandStrのgetter, setter
-        std::string getOperand() { return operandStr; }
-        void setOperand(std::string str) { operandStr = str; } 
+        StringRef getOperand() { return operandStr; }
+        void setOperand(StringRef str) { operandStr = str; }
+        // 演算子のBinOp(二項演算子でなければBinOp::Invalid)
+        BinOp getBinOp() { return binOp; }
 
-        void initStream(std::string fileName) { iFile.open(fileName); }
+        // ファイル全体を読み込む。大きなファイルはMemoryBufferがmmapする。
+        bool initStream(std::string fileName) {
+            auto BufOrErr = MemoryBuffer::getFile(fileName);
+            if (!BufOrErr) {
+                diags() << "Could not open " << fileName << ": "
+                    << BufOrErr.getError().message() << "\n";
+                return false;
+            }
+            setBuffer(std::move(*BufOrErr));
+            return true;
+        }
+        // メモリ上のソースを読み込む(コピーして末尾に番兵の'\0'を付ける)
+        void initBuffer(StringRef source, StringRef name = "<buffer>") {
+            setBuffer(MemoryBuffer::getMemBufferCopy(source, name));
+        }
+        // REPL用に標準入力から一行ずつ読み込む
+        void initStdin() {
+            interactive = true;
+            replLine.clear();
+            cur = end = replLine.c_str();
+        }
 
     private:
-        std::ifstream iFile;
+        std::unique_ptr<MemoryBuffer> buffer;
+        const char *cur = "";
+        const char *end = cur;
+        // REPLの場合、今読んでいる行
+        bool interactive = false;
+        std::string replLine;
+
         int intVal;
         double doubleVal;
-        std::string identifierStr;
-        std::string operandStr;
-        static char getNextChar(std::ifstream &is) {
-            char c = '\0';
-            if (is.good())
-                is.get(c);
-
-            return c;
+        StringRef identifierStr;
+        Symbol identifierSym = EmptySymbol;
+        StringRef numberStr;
+        StringRef operandStr;
+        BinOp binOp = BinOp::Invalid;
+
+        void setBuffer(std::unique_ptr<MemoryBuffer> buf) {
+            buffer = std::move(buf);
+            cur = buffer->getBufferStart();
+            end = buffer->getBufferEnd();
+        }
+
+        // refill - REPLの場合に標準入力から次の一行を読む。読めなければfalseを返す。
+        bool refill() {
+            if (!interactive || !std::getline(std::cin, replLine))
+                return false;
+            replLine += '\n';
+            cur = replLine.c_str();
+            end = cur + replLine.size();
+            return true;
         }
 };
@@ -1,52 +1,111 @@
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <map>
 #include <set>
 #include <memory>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
+#include <sys/resource.h>
 
 using namespace llvm;
 using namespace llvm::sys;
 
+#include "option.h"
+#include "diag.h"
+#include "report.h"
+
+#include "symbol.h"
+
+#include "scan.h"
+
 #include "lexer.h"
 
-Lexer lexer;
+static thread_local Lexer lexer;
+
+#include "astcontext.h"
 
 #include "parser.h"
 
+#include "consteval.h"
+
+#include "sema.h"
+
 #include "codegen.h"
 
+#include "helper/multiversion.h"
 #include "helper/helper.h"
+#include "helper/parallel.h"
+#include "cache.h"
+
+#include "jit.h"
+
+#include "driver.h"
+
+// bench/frontbench.cppはMC_NO_MAINを定義してこのファイルをincludeし、コンパイラの
+// 各フェーズを直接呼び出す。
+#ifndef MC_NO_MAIN
 
 //===----------------------------------------------------------------------===//
 // Main driver code.
@@ -54,38 +113,203 @@ Lexer lexer;
 //===----------------------------------------------------------------------===//
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cout << "./mc file.mc" << std::endl;
+    // コマンドライン引数の解析
+    // "-O0"〜"-O3"で最適化レベルを指定する。"-O"は"-O1"と同じ。
+    // "-march=native|<cpu>"で出力するコードのCPUを指定する。
+    // "--multiversion"で公開関数をISAレベル毎に複製する。
+    // "--jit"でファイルをJITで実行し、"--repl"で標準入力を対話的に実行する。
+    // "-fconstexpr-steps=N", "-fconstexpr-depth=N"でコンパイル時の定数評価の上限を変える。
+    // "-ffp-mode=strict|contract|fast"で浮動小数点数の演算のモードを指定する(デフォルトはstrict)。
+    // "--stats"で統計を、"--time-report"で各フェーズの時間を表示する。"=json"を付けるとJSONで表示する。
+    // "-j N"(または"-jN")でオブジェクトの出力をNスレッドで並列に行う。
+    // 複数のファイルを指定した場合は、Nファイルを並列にコンパイルする。
+    // "-o FILE"で出力するオブジェクトファイルの名前を指定する。複数のファイルを指定した場合は、
+    // 一つのFILEにまとめる("-o"が無ければ各ファイルを"<名前>.o"に出力する)。
+    // "--cache-dir=DIR"(または"--cache")で関数毎のオブジェクトコードをキャッシュする。
+    // "--emit=bc|thinlto"でオブジェクトファイルの代わりにビットコードを出力する(-flto用)。
+    // "--instrument[=FILE]"でPGOのカウンタを入れ、"--profile-use=FILE"でプロファイルを使って最適化する。
+    // "--profile-calls"で関数毎の呼び出し回数とサイクル数を数える。
+    std::vector<std::string> fileNames;
+    std::string outputName;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-O") {
+            OptLevel = 1;
+        } else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+                arg[2] >= '0' && arg[2] <= '3') {
+            OptLevel = arg[2] - '0';
+        } else if (arg.compare(0, 7, "-march=") == 0) {
+            TargetCPU = arg.substr(7);
+        } else if (arg == "--multiversion") {
+            MultiVersion = true;
+        } else if (arg == "--jit") {
+            Mode = RUN_JIT;
+        } else if (arg == "--repl") {
+            Mode = RUN_REPL;
+        } else if (arg.compare(0, 18, "-fconstexpr-steps=") == 0) {
+            ConstEvalStepLimit = strtoull(arg.c_str() + 18, nullptr, 10);
+        } else if (arg.compare(0, 18, "-fconstexpr-depth=") == 0) {
+            ConstEvalDepthLimit = strtoul(arg.c_str() + 18, nullptr, 10);
+        } else if (arg.compare(0, 10, "-ffp-mode=") == 0) {
+            std::string mode = arg.substr(10);
+            if (mode == "strict") {
+                DefaultFPMode = FP_STRICT;
+            } else if (mode == "contract") {
+                DefaultFPMode = FP_CONTRACT;
+            } else if (mode == "fast") {
+                DefaultFPMode = FP_FAST;
+            } else {
+                std::cerr << "-ffp-mode must be strict, contract or fast" << std::endl;
+                return -1;
+            }
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            std::string n = arg.substr(2);
+            if (n.empty() && i + 1 < argc)
+                n = argv[++i];
+            Jobs = strtoul(n.c_str(), nullptr, 10);
+            if (Jobs == 0) {
+                std::cerr << "-j requires a positive number of jobs" << std::endl;
+                return -1;
+            }
+        } else if (arg == "-o") {
+            if (i + 1 == argc) {
+                std::cerr << "-o requires a file name" << std::endl;
+                return -1;
+            }
+            outputName = argv[++i];
+        } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+            CacheDir = arg.substr(12);
+        } else if (arg == "--cache") {
+            SmallString<128> Dir;
+            if (!sys::path::user_cache_directory(Dir, "mc")) {
+                std::cerr << "could not find the user cache directory; use --cache-dir=DIR" << std::endl;
+                return -1;
+            }
+            CacheDir = Dir.str().str();
+        } else if (arg.compare(0, 7, "--emit=") == 0) {
+            std::string kind = arg.substr(7);
+            if (kind == "obj") {
+                EmitMode = EMIT_OBJ;
+            } else if (kind == "bc") {
+                EmitMode = EMIT_BC;
+            } else if (kind == "thinlto") {
+                EmitMode = EMIT_THINLTO;
+            } else {
+                std::cerr << "--emit must be obj, bc or thinlto" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--instrument" || arg.compare(0, 13, "--instrument=") == 0) {
+            Instrument = true;
+            if (arg.size() > 12)
+                InstrumentFile = arg.substr(13);
+        } else if (arg.compare(0, 14, "--profile-use=") == 0) {
+            ProfileUseFile = arg.substr(14);
+        } else if (arg == "--profile-calls") {
+            ProfileCalls = true;
+        } else if (arg == "--stats" || arg == "--stats=json") {
+            PrintStats = true;
+            ReportJSON |= arg == "--stats=json";
+        } else if (arg == "--time-report" || arg == "--time-report=json") {
+            TimeReport = true;
+            ReportJSON |= arg == "--time-report=json";
+        } else if (arg[0] == '-') {
+            std::cerr << "unknown option: " << arg << std::endl;
+            return -1;
+        } else {
+            fileNames.push_back(arg);
+        }
+    }
+
+    if ((fileNames.empty() && Mode != RUN_REPL) || (fileNames.size() > 1 && Mode != RUN_OBJECT)) {
+        std::cout << "./mc [-O0|-O1|-O2|-O3] [-march=native|<cpu>] [--multiversion] [-ffp-mode=strict|contract|fast] [-j N] [--cache|--cache-dir=DIR] [--emit=obj|bc|thinlto] [--instrument[=FILE]|--profile-use=FILE] [--profile-calls] [--stats[=json]] [--time-report[=json]] [-o output.o] file.mc..." << std::endl;
+        std::cout << "./mc [-O0|-O1|-O2|-O3] [--profile-use=FILE] --jit file.mc" << std::endl;
+        std::cout << "./mc [-O0|-O1|-O2|-O3] [--profile-use=FILE] --repl" << std::endl;
         return -1;
     }
 
-    // mc言語のテキストファイルの読み込み
-    std::string fileName = argv[1];
-    lexer.initStream(fileName);
+    // ビットコードは入力毎にModuleを分割せず一つのファイルに書く。`ld -r`でもまとめられない。
+    if (EmitMode != EMIT_OBJ && (!CacheDir.empty() ||
+                (fileNames.size() == 1 ? Jobs > 0 : !outputName.empty()))) {
+        std::cerr << "--emit=bc and --emit=thinlto write one file per input; they cannot be used "
+            "with the object cache, -j for a single file or -o with multiple files" << std::endl;
+        return -1;
+    }
 
-    // 二項演算子の定義
-    // 数字が低いほど結合度が低い
-    // TODO 3.1: "<"を実装してみよう
-    // BinopPrecedenceに"<"を登録して下さい。
-    BinopPrecedence["!="] = 10;
-    BinopPrecedence["=="] = 10;
+    // PGOのパスは最適化のパイプラインに入るので、-O0では何もされない。
+    // カウンタはリンクしたプログラムの終了時に書き出されるので、JITでは計測できない。
+    // プロファイルは関数の制御フローのハッシュで照合するが、最初に小さな関数をインライン展開
+    // してから計測するので、関数毎に分けてコンパイルする(--cache, 一つのファイルの-j)と合わなくなる。
+    if (Instrument || !ProfileUseFile.empty()) {
+        if (Instrument && !ProfileUseFile.empty()) {
+            std::cerr << "only one of --instrument and --profile-use can be specified" << std::endl;
+            return -1;
+        }
+        if (OptLevel == 0) {
+            std::cerr << "--instrument and --profile-use require -O1 or higher" << std::endl;
+            return -1;
+        }
+        if (Instrument && Mode != RUN_OBJECT) {
+            std::cerr << "--instrument cannot be used with --jit or --repl" << std::endl;
+            return -1;
+        }
+        if (!CacheDir.empty() || (fileNames.size() == 1 && Jobs > 0)) {
+            std::cerr << "--instrument and --profile-use cannot be used with the object cache "
+                "or -j for a single file" << std::endl;
+            return -1;
+        }
+        if (!ProfileUseFile.empty() && !sys::fs::exists(ProfileUseFile)) {
+            std::cerr << "could not open profile " << ProfileUseFile << std::endl;
+            return -1;
+        }
+    }
 
-    BinopPrecedence["<"] = 20;
-    BinopPrecedence["<="] = 20;
-    BinopPrecedence[">"] = 20;
-    BinopPrecedence[">="] = 20;
+    // --profile-callsの結果はリンクしたプログラムの終了時に書き出すので、JITでは使えない。
+    if (ProfileCalls && Mode != RUN_OBJECT) {
+        std::cerr << "--profile-calls cannot be used with --jit or --repl" << std::endl;
+        return -1;
+    }
+
+    // LLVMのパスの時間は、一つのスレッドでコンパイルする場合だけ測る。
+    if (TimeReport && Mode == RUN_OBJECT && fileNames.size() == 1 && Jobs == 0)
+        TimePassesIsEnabled = true;
 
-    BinopPrecedence["+"] = 30;
-    BinopPrecedence["-"] = 30;
+    bool ok = true;
+    if (Mode == RUN_OBJECT) {
+        InitializeTargets();
+        if (fileNames.size() == 1) {
+            CompileJob job;
+            job.input = fileNames[0];
+            job.output = outputName.empty() ? "output.o" : outputName;
+            compileFile(job);
+            if (job.ok)
+                outs() << "Wrote " << job.output << "\n";
+            ok = job.ok;
+        } else {
+            // -jはファイル単位の並列度に使い、各ファイルの中ではModuleを分割しない。
+            unsigned numThreads = std::max(Jobs, 1u);
+            Jobs = 0;
+            ok = compileFiles(fileNames, outputName, numThreads);
+        }
+    } else {
+        // JITの場合はmc言語のテキストファイルを読み込み、REPLの場合は標準入力から読む
+        if (Mode == RUN_REPL)
+            lexer.initStdin();
+        else if (!lexer.initStream(fileNames[0]))
+            return -1;
 
-    BinopPrecedence["*"] = 40;
-    BinopPrecedence["/"] = 40;
+        if (!InitializeJIT())
+            return -1;
 
-    getNextToken();
+        if (Mode == RUN_REPL)
+            fprintf(stderr, "ready> ");
+        getNextToken();
 
-    MainLoop();
-    
-    write_output();
+        MainLoop();
+
+        if (TimeReport || PrintStats)
+            printReport(Mode == RUN_REPL ? "<stdin>" : fileNames[0], 0);
+    }
 
-    return 0;
+    return ok ? 0 : -1;
 }
+#endif // MC_NO_MAIN
@@ -0,0 +1,90 @@
+//===----------------------------------------------------------------------===//
+// Option
+// コンパイラのコマンドラインオプションを保持する。値はmc.cppのmain関数で
+// argvを読んでセットされ、codegen.hやhelper/helper.hから参照される。
+//===----------------------------------------------------------------------===//
+
+// 最適化レベル(-O0〜-O3)。0の場合はIRに対して最適化パスを一切走らせない。
+static unsigned OptLevel = 0;
+
+// RunMode - コンパイラの動作モード。
+// RUN_OBJECT: オブジェクトファイル(-oが無ければoutput.o)を出力する(デフォルト)
+// RUN_JIT:    --jit。ファイルの各定義をJITでコンパイルし、top level expressionを即座に実行する
+// RUN_REPL:   --repl。標準入力から一つずつ読み、RUN_JITと同様に実行する
+enum RunMode {
+    RUN_OBJECT = 0,
+    RUN_JIT = 1,
+    RUN_REPL = 2
+};
+static RunMode Mode = RUN_OBJECT;
+
+// EmitKind - RUN_OBJECTで出力するファイルの形式。--emit=obj|bc|thinltoで指定する。
+// EMIT_OBJ:     オブジェクトファイル(デフォルト)
+// EMIT_BC:      LLVMのビットコード。clang++ -fltoでC++と一緒にリンク時最適化できる
+// EMIT_THINLTO: ThinLTOのサマリ付きのビットコード。clang++ -flto=thinでリンクする
+// ビットコードの場合もファイル名はoutput.o等のままで、リンカーは中身で判別する。
+enum EmitKind {
+    EMIT_OBJ = 0,
+    EMIT_BC = 1,
+    EMIT_THINLTO = 2
+};
+static EmitKind EmitMode = EMIT_OBJ;
+
+// PGO(プロファイルに基づく最適化)。どちらも-O1以上で、オブジェクトファイルを出力する場合に使う。
+// --instrument[=FILE]: 各関数に分岐毎の実行回数を数えるカウンタを入れる。compiler-rtの
+//   プロファイルのランタイムとリンク(clang++ -fprofile-generate)して実行すると、終了時に
+//   FILE(省略するとdefault.profraw。環境変数LLVM_PROFILE_FILEが優先)に書き出す。
+// --profile-use=FILE: llvm-profdata mergeで作ったFILEから分岐の重みと関数の呼び出し回数を
+//   付け、よく通る枝の配置やインライン展開、ループの展開の判断に使う。
+//   計測した時と同じ最適化レベルでコンパイルすること(関数の形が変わるとプロファイルが合わない)。
+static bool Instrument = false;
+static std::string InstrumentFile;
+static std::string ProfileUseFile;
+
+// --profile-callsが指定された場合、各関数の呼び出し回数とサイクル数を数え、
+// 終了時(またはmc_profile_dump()を呼んだ時)にCSVで標準エラー出力に書く。
+static bool ProfileCalls = false;
+
+// -march=で指定されたCPU名。"native"の場合はコンパイルしているマシンのCPU名と
+// 命令セット拡張(AVX2やFMA等)を使う。
+static std::string TargetCPU = "generic";
+
+// --multiversionが指定された場合、公開関数をISAレベル毎に複製してifuncで選ぶ。
+static bool MultiVersion = false;
+
+// コンパイル時の定数評価(consteval.h)の上限。
+// -fconstexpr-steps=で評価するノード数の、-fconstexpr-depth=で関数呼び出しの深さの上限を変える。
+static uint64_t ConstEvalStepLimit = 1 << 24;
+static unsigned ConstEvalDepthLimit = 512;
+
+// -j Nで、オブジェクトの出力をNスレッドで並列に行う。0の場合はModuleを分割せずに一度に出力する。
+// 複数のファイルをコンパイルする場合は、ファイル単位の並列度になる(driver.h)。
+static unsigned Jobs = 0;
+
+// --cache-dir=DIR(--cacheなら~/.cache/mc)で、関数毎のオブジェクトコードをDIRにキャッシュする。
+// 空の場合はキャッシュしない。
+static std::string CacheDir;
+
+// FPMode - 浮動小数点数の演算の意味。
+// FP_STRICT:   書いた通りの順番で計算し、各演算で丸める(デフォルト)
+// FP_CONTRACT: a * b + cを一つのFMA命令にまとめることを許す(丸めが一回減る)
+// FP_FAST:     結合則による並べ替えや、NaNや無限大が無いという仮定を許す(fast-math)。
+//              浮動小数点数の合計のループもベクトル化できるようになる。
+// -ffp-mode=strict|contract|fastで全体のモードを、defのアノテーション
+// (fpstrict, fpcontract, fpfast)で関数毎のモードを指定する。
+enum FPMode {
+    FP_STRICT = 0,
+    FP_CONTRACT = 1,
+    FP_FAST = 2
+};
+static FPMode DefaultFPMode = FP_STRICT;
+
+// --statsが指定された場合、ファイル毎にコンパイラ内部の統計(トークンやASTのノードの数、
+// ASTのアロケーション等)を表示する。
+static bool PrintStats = false;
+
+// --time-reportが指定された場合、ファイル毎にコンパイルの各フェーズとLLVMのパスの時間を表示する。
+static bool TimeReport = false;
+
+// --stats=jsonや--time-report=jsonのように指定された場合、統計や時間をJSONで表示する。
+static bool ReportJSON = false;
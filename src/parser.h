@@ -10,134 +10,592 @@
 enum NumType {
     DEFAULT = -1, //codegenの段階でNumTypeが確定する。これはそれより前の仮の状態。
     INT = 0,
-    DOUBLE = 1
+    DOUBLE = 1,
+    // 配列(int[], double[])。関数の引数にだけ使え、C++からはポインタと長さの
+    // 二つの引数として渡す。
+    INT_ARRAY = 2,
+    DOUBLE_ARRAY = 3,
+    // SIMDのベクトル(double4等)。LLVMの固定長ベクトル(<4 x double>等)になり、
+    // 演算子は要素毎に計算する。
+    DOUBLE2 = 4,
+    DOUBLE4 = 5,
+    DOUBLE8 = 6,
+    INT2 = 7,
+    INT4 = 8,
+    INT8 = 9,
+    // 真偽値。比較演算子や&&, ||, !の結果で、ifの条件にそのまま使える。
+    // LLVMではi1になり、C++からはboolとして渡す。
+    BOOL = 10
 };
 
-NumType returnType(NumType type1, NumType type2) {
-    if (type1 == DEFAULT || type2 == DEFAULT) {
-        return DEFAULT;
-    } else if (type1 == DOUBLE || type2 == DOUBLE) {
-        return DOUBLE;
-    } else {
-        return INT;
+// ベクトル型の名前と、要素の型、要素数
+struct VectorTypeInfo {
+    const char *name;
+    NumType type;
+    NumType elem;
+    unsigned width;
+};
+static const VectorTypeInfo VectorTypes[] = {
+    {"double2", DOUBLE2, DOUBLE, 2},
+    {"double4", DOUBLE4, DOUBLE, 4},
+    {"double8", DOUBLE8, DOUBLE, 8},
+    {"int2", INT2, INT, 2},
+    {"int4", INT4, INT, 4},
+    {"int8", INT8, INT, 8},
+};
+
+static const VectorTypeInfo *getVectorTypeInfo(NumType t) {
+    for (const VectorTypeInfo &info : VectorTypes) {
+        if (info.type == t)
+            return &info;
+    }
+    return nullptr;
+}
+static bool isVectorType(NumType t) {
+    return getVectorTypeInfo(t) != nullptr;
+}
+// ベクトルの要素の型(スカラーの型はそのまま)
+static NumType getScalarType(NumType t) {
+    const VectorTypeInfo *info = getVectorTypeInfo(t);
+    return info ? info->elem : t;
+}
+// ベクトルの要素数(スカラーは1)
+static unsigned getVectorWidth(NumType t) {
+    const VectorTypeInfo *info = getVectorTypeInfo(t);
+    return info ? info->width : 1;
+}
+// 要素の型がelemで要素数がwidthのベクトル型。無ければDEFAULT。
+static NumType getVectorType(NumType elem, unsigned width) {
+    for (const VectorTypeInfo &info : VectorTypes) {
+        if (info.elem == elem && info.width == width)
+            return info.type;
+    }
+    return DEFAULT;
+}
+// 名前がベクトル型ならその型、そうでなければDEFAULT
+static NumType lookupVectorType(StringRef name) {
+    for (const VectorTypeInfo &info : VectorTypes) {
+        if (name == info.name)
+            return info.type;
     }
+    return DEFAULT;
+}
+
+static bool isArrayType(NumType t) {
+    return t == INT_ARRAY || t == DOUBLE_ARRAY;
+}
+// 要素の型がelemの配列の型
+static NumType getArrayType(NumType elem) {
+    return elem == INT ? INT_ARRAY : DOUBLE_ARRAY;
+}
+// 配列の要素の型
+static NumType getElementType(NumType array) {
+    return array == INT_ARRAY ? INT : DOUBLE;
 }
 
 struct ArgTuple {
-    std::string name;
+    Symbol name;
     NumType type;
 };
 
+// 定数評価器(consteval.h)
+struct ConstValue;
+class ConstEvaluator;
+// 意味解析(sema.h)
+class Sema;
+// オブジェクトのキャッシュのキーを作るハッシュ(cache.h)
+class ASTHasher;
+
+// FnAttr - "def tailrec double f(...)"の"tailrec"のような、関数に付けられたアノテーション。
+// PrototypeASTはこれらのビットの組み合わせを持つ。
+enum FnAttr {
+    ATTR_TAILREC = 1 << 0,     // 自分自身を末尾位置でしか呼ばない事を保証する
+    ATTR_MEMO = 1 << 1,        // 引数をキーにして結果をキャッシュする
+    ATTR_FP_STRICT = 1 << 2,   // 浮動小数点数の演算をFP_STRICTにする(-ffp-modeより優先)
+    ATTR_FP_CONTRACT = 1 << 3, // FP_CONTRACTにする
+    ATTR_FP_FAST = 1 << 4      // FP_FASTにする
+};
+static const unsigned ATTR_FP_MASK = ATTR_FP_STRICT | ATTR_FP_CONTRACT | ATTR_FP_FAST;
+
+// TailCallInfo - 関数の中の自分自身への呼び出しを、末尾呼び出しとそれ以外に分けて数える。
+struct TailCallInfo {
+    int tailCalls = 0;
+    int nonTailCalls = 0;
+};
+
 namespace {
+    class PrototypeAST;
+
     // ExprAST - `5+2`や`2*10-2`等のexpressionを表すクラス
+    // ノードはASTContextが確保してまとめて解放するので、deleteはしない(デストラクタも無い)。
     class ExprAST {
         public:
-            virtual ~ExprAST() = default;
             virtual Value *codegen() = 0;
+            // codegenCondBr - このexpressionを条件として、真ならTrueBB、偽ならFalseBBに分岐する
+            // IRを作る(codegen.h)。比較はi1のまま分岐に使い、&&, ||, !は値を作らずに分岐を繋ぐ。
+            virtual bool codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB);
+            // このexpressionの型。analyzeが決める。
             NumType type = DEFAULT;
-            virtual NumType checkType() {return DEFAULT;}
+            // analyze - 子ノードを含めて型を決め、呼び出し先を解決する(sema.h)。
+            // 型のエラーがあればエラーを表示してfalseを返す。
+            virtual bool analyze(Sema &S) = 0;
+            // analyzeTailCalls - 関数fnName自身への呼び出しを探し、infoに数える。
+            // isTailはこのexpressionの値がそのまま関数の返り値になる(末尾位置にある)かどうか。
+            virtual void analyzeTailCalls(Symbol fnName, bool isTail,
+                    TailCallInfo &info) {}
+            // collectCallees - このexpressionの中で呼ばれている関数の名前をcalleesに集める。
+            virtual void collectCallees(std::set<Symbol> &callees) {}
+            // evaluate - コンパイル時にこのexpressionの値を計算できればresultにセットしてtrueを返す。
+            virtual bool evaluate(ConstEvaluator &ev, ConstValue &result) { return false; }
+            // foldConstants - 子ノードのうちコンパイル時に計算できるものをNumberASTに置き換える。
+            // 子ノードが全て定数になった(自分もevaluateできる見込みがある)場合にtrueを返す。
+            virtual bool foldConstants() { return false; }
+            virtual bool isNumber() { return false; }
+            // hash - このexpressionの(正規化した)構造をハッシュに加える(cache.h)。
+            virtual void hash(ASTHasher &H) = 0;
     };
 
     // NumberAST - `5`や`2`等の数値リテラルを表すクラス
     class NumberAST : public ExprAST {
         // 実際に数値の値を保持する変数
-        int intVal;
+        int64_t intVal;
         double doubleVal;
 
         public:
+        static const ASTNodeKind Kind = NODE_NUMBER;
+
         NumberAST(double Val) {
             type = DOUBLE;
             doubleVal = Val;
         }
-        NumberAST(int Val) {
+        NumberAST(int64_t Val) {
             type = INT;
             intVal = Val;
         }
-        NumType checkType() override {
-            return type;
+        // trueとfalse。値はintValに1か0で持つ。
+        NumberAST(bool Val) {
+            type = BOOL;
+            intVal = Val;
         }
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override { return true; }
+        bool isNumber() override { return true; }
+        bool isZero() const { return type == INT ? intVal == 0 : doubleVal == 0.0; }
+        int64_t getIntValue() const { return intVal; }
         Value *codegen() override;
     };
 
     // BinaryAST - `+`や`*`等の二項演算子を表すクラス
     class BinaryAST : public ExprAST {
-        std::string Op;
-        std::unique_ptr<ExprAST> LHS, RHS;
+        BinOp Op;
+        ExprAST *LHS, *RHS;
+
+        public:
+        static const ASTNodeKind Kind = NODE_BINARY;
+
+        BinaryAST(BinOp Op, ExprAST *LHS, ExprAST *RHS)
+            : Op(Op), LHS(LHS), RHS(RHS) {}
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            LHS->analyzeTailCalls(fnName, false, info);
+            RHS->analyzeTailCalls(fnName, false, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            LHS->collectCallees(callees);
+            RHS->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
+        Value *codegen() override;
+        bool codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB) override;
+    };
+
+    // NotExprAST - 論理否定`!e`を表すクラス
+    class NotExprAST : public ExprAST {
+        ExprAST *Operand;
 
         public:
-        BinaryAST(std::string Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-        NumType checkType() override {
-            return returnType(LHS->checkType(), RHS->checkType());
+        static const ASTNodeKind Kind = NODE_NOT;
+
+        NotExprAST(ExprAST *Operand) : Operand(Operand) {}
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            Operand->analyzeTailCalls(fnName, false, info);
         }
+        void collectCallees(std::set<Symbol> &callees) override {
+            Operand->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
         Value *codegen() override;
+        bool codegenCondBr(BasicBlock *TrueBB, BasicBlock *FalseBB) override;
     };
 
     // VariableExprAST - 変数の名前を表すクラス
     class VariableExprAST : public ExprAST {
-        std::string variableName;
+        Symbol variableName;
 
         public:
-        VariableExprAST(const std::string &variableName) : variableName(variableName) {}
-        NumType checkType() override;
+        static const ASTNodeKind Kind = NODE_VARIABLE;
+
+        VariableExprAST(Symbol variableName) : variableName(variableName) {}
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        Value *codegen() override;
+        Symbol getName() const { return variableName; }
+        // codegenLength - 配列の変数の長さ。配列の値はポインタなので、長さは別に得る。
+        Value *codegenLength();
+    };
+
+    // IndexExprAST - 配列の要素`xs[i]`と、要素への代入`xs[i] = e`を表すクラス
+    // 代入の場合は代入した値がこのexpressionの値になる。
+    class IndexExprAST : public ExprAST {
+        Symbol arrayName;
+        ExprAST *Index;
+        // 代入する値。読むだけの場合はnullptr。
+        ExprAST *StoreValue;
+
+        public:
+        static const ASTNodeKind Kind = NODE_INDEX;
+
+        IndexExprAST(Symbol arrayName, ExprAST *Index, ExprAST *StoreValue)
+            : arrayName(arrayName), Index(Index), StoreValue(StoreValue) {}
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            Index->analyzeTailCalls(fnName, false, info);
+            if (StoreValue)
+                StoreValue->analyzeTailCalls(fnName, false, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            Index->collectCallees(callees);
+            if (StoreValue)
+                StoreValue->collectCallees(callees);
+        }
+        bool foldConstants() override;
+        Value *codegen() override;
+    };
+
+    // Builtin - len(xs)のような組み込み関数。名前は予約されていて、同じ名前の関数は呼べない。
+    // Nやiの付いた引数は整数のリテラル(定数畳み込みの結果でもよい)でなければならない。
+    enum Builtin {
+        BUILTIN_NONE,
+        BUILTIN_LEN,        // len(xs): 配列の長さ(int)
+        BUILTIN_BROADCAST,  // broadcast(x, N): スカラーxをN個並べたベクトル
+        BUILTIN_SHUFFLE,    // shuffle(a, b, i0, i1, ...): aとbを繋げたベクトルのi0, i1, ...番目の要素
+        BUILTIN_SELECT,     // select(mask, a, b): 要素毎にmaskが0でなければa、0ならb
+                            // (スカラーの場合はmaskがbool)
+        BUILTIN_HADD,       // hadd(v): 全ての要素の和
+        BUILTIN_HMUL,       // hmul(v): 全ての要素の積
+        BUILTIN_HMIN,       // hmin(v): 最小の要素
+        BUILTIN_HMAX,       // hmax(v): 最大の要素
+        BUILTIN_LOAD,       // load(xs, i, N): 配列のxs[i]からN個の要素のベクトル
+        BUILTIN_STORE       // store(xs, i, v): ベクトルvをxs[i]から書き込み、vを返す
+    };
+
+    // BuiltinCallAST - 組み込み関数の呼び出しを表すクラス
+    class BuiltinCallAST : public ExprAST {
+        Builtin builtin;
+        // 引数の配列はASTContextに確保されている
+        MutableArrayRef<ExprAST *> ArgList;
+
+        public:
+        static const ASTNodeKind Kind = NODE_BUILTIN;
+
+        BuiltinCallAST(Builtin builtin, MutableArrayRef<ExprAST *> ArgList)
+            : builtin(builtin), ArgList(ArgList) {}
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            for (ExprAST *arg : ArgList)
+                arg->analyzeTailCalls(fnName, false, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            for (ExprAST *arg : ArgList)
+                arg->collectCallees(callees);
+        }
+        bool foldConstants() override;
         Value *codegen() override;
     };
 
     // CallExprAST - 関数呼び出しを表すクラス
     class CallExprAST : public ExprAST {
-        std::string callee;
-        std::vector<std::unique_ptr<ExprAST>> ArgList;
+        Symbol callee;
+        // 引数の配列はASTContextに確保されている
+        MutableArrayRef<ExprAST *> ArgList;
+        // 呼び出し先のシグネチャ。analyzeが決める。
+        PrototypeAST *calleeProto = nullptr;
+        // 自分自身への末尾呼び出しで、ループに変換するかどうか
+        bool isSelfTailCall = false;
 
         public:
-        CallExprAST(const std::string &callee,
-                std::vector<std::unique_ptr<ExprAST>> ArgList)
-            : callee(callee), ArgList(std::move(ArgList)) {}
-
-        NumType checkType() override;
+        static const ASTNodeKind Kind = NODE_CALL;
+
+        CallExprAST(Symbol callee, MutableArrayRef<ExprAST *> ArgList)
+            : callee(callee), ArgList(ArgList) {}
+
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            for (ExprAST *arg : ArgList)
+                arg->analyzeTailCalls(fnName, false, info);
+            if (callee != fnName)
+                return;
+            if (isTail)
+                info.tailCalls++;
+            else
+                info.nonTailCalls++;
+            isSelfTailCall = isTail;
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            callees.insert(callee);
+            for (ExprAST *arg : ArgList)
+                arg->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
         Value *codegen() override;
     };
 
     // PrototypeAST - 関数シグネチャーのクラスで、関数の名前と引数の名前を表すクラス
     class PrototypeAST {
-        std::string Name;
-        std::vector<ArgTuple> ArgList;
+        Symbol Name;
+        // 引数の配列はASTContextに確保されている
+        ArrayRef<ArgTuple> ArgList;
         NumType type;
+        // FnAttrの組み合わせ
+        unsigned Attributes;
 
         public:
-        PrototypeAST(const std::string &Name, std::vector<ArgTuple> ArgList, NumType type)
-            : Name(Name), ArgList(std::move(ArgList)), type(type) {}
+        static const ASTNodeKind Kind = NODE_PROTOTYPE;
+
+        PrototypeAST(Symbol Name, ArrayRef<ArgTuple> ArgList, NumType type,
+                unsigned Attributes = 0)
+            : Name(Name), ArgList(ArgList), type(type), Attributes(Attributes) {}
 
         Function *codegen();
-        const std::string &getFunctionName() const { return Name; }
+        Symbol getName() const { return Name; }
+        StringRef getFunctionName() const { return Symbols.getName(Name); }
+        ArrayRef<ArgTuple> getArgs() const { return ArgList; }
+        NumType getType() const { return type; }
+        void setType(NumType t) { type = t; }
+        bool hasAttribute(FnAttr attr) const { return (Attributes & attr) != 0; }
+        // getFPMode - この関数の浮動小数点数の演算のモード。アノテーションが無ければ-ffp-modeの値。
+        FPMode getFPMode() const {
+            if (hasAttribute(ATTR_FP_FAST))
+                return FP_FAST;
+            if (hasAttribute(ATTR_FP_CONTRACT))
+                return FP_CONTRACT;
+            if (hasAttribute(ATTR_FP_STRICT))
+                return FP_STRICT;
+            return DefaultFPMode;
+        }
+        bool hasArrayArgs() const {
+            for (const ArgTuple &arg : ArgList) {
+                if (isArrayType(arg.type))
+                    return true;
+            }
+            return false;
+        }
     };
 
     // FunctionAST - 関数シグネチャー(PrototypeAST)に加えて関数のbody(C++で言うint foo) {...}の中身)を
     // 表すクラスです。
     class FunctionAST {
-        std::unique_ptr<PrototypeAST> proto;
-        std::unique_ptr<ExprAST> body;
+        PrototypeAST *proto;
+        ExprAST *body;
+        // analyzeで上書きする前に登録されていたシグネチャ。
+        PrototypeAST *prevProto = nullptr;
 
         public:
-        FunctionAST(std::unique_ptr<PrototypeAST> proto,
-                std::unique_ptr<ExprAST> body)
-            : proto(std::move(proto)), body(std::move(body)) {}
+        static const ASTNodeKind Kind = NODE_FUNCTION;
 
+        FunctionAST(PrototypeAST *proto, ExprAST *body)
+            : proto(proto), body(body) {}
+
+        // analyze - シグネチャを登録し、bodyの意味解析をする(sema.h)。
+        bool analyze();
+        // restorePrototype - analyzeで登録したシグネチャを取り消し、以前の定義(あれば)に戻す。
+        // 意味解析の後でcodegenが失敗した場合にも呼ぶ。
+        void restorePrototype();
         Function *codegen();
+        const PrototypeAST &getProto() const { return *proto; }
+        ExprAST &getBody() { return *body; }
     };
 
     class IfExprAST : public ExprAST {
-        std::unique_ptr<ExprAST> Cond, Then, Else;
-        NumType type;
+        ExprAST *Cond, *Then, *Else;
+        // 関数の末尾位置にあるかどうか。末尾再帰をループにする関数では、
+        // 末尾位置のif文はphiでマージせずにそれぞれの枝からreturnする。
+        bool isTail = false;
+
+        public:
+        static const ASTNodeKind Kind = NODE_IF;
+
+        IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : Cond(Cond), Then(Then), Else(Else) {}
+
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            this->isTail = isTail;
+            Cond->analyzeTailCalls(fnName, false, info);
+            Then->analyzeTailCalls(fnName, isTail, info);
+            Else->analyzeTailCalls(fnName, isTail, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            Cond->collectCallees(callees);
+            Then->collectCallees(callees);
+            Else->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
+        Value *codegen() override;
+    };
+
+    // ForExprAST - `for i = start, end, step in body`を表すクラス
+    // iをstartからstepずつ増やしながら、i < endの間bodyを計算し、その合計を値にする
+    // (一度も回らなければ0)。stepは省略すると1。stepが負ならi > endの間回り、0(やNaN)なら
+    // 一度も回らない。向きはstepの値で決まり、定数でなければ実行時に符号を調べる。
+    // MCの式には副作用が無いので、endとstepはループに入る前に一度だけ計算する。
+    // "for vectorize unroll 4 i = ..."のように、ループ変数の前にループの最適化の
+    // ヒントを書ける(codegenでllvm.loopのメタデータになる)。
+    class ForExprAST : public ExprAST {
+        Symbol varName;
+        ExprAST *Start, *End, *Step, *Body;
+        // ヒント。vectorize: ベクトル化を強制する, unroll N: N回展開する(0なら指定無し)
+        bool vectorize;
+        unsigned unrollCount;
+
+        public:
+        static const ASTNodeKind Kind = NODE_FOR;
+
+        ForExprAST(Symbol varName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+                ExprAST *Body, bool vectorize, unsigned unrollCount)
+            : varName(varName), Start(Start), End(End), Step(Step), Body(Body),
+            vectorize(vectorize), unrollCount(unrollCount) {}
+
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            Start->analyzeTailCalls(fnName, false, info);
+            End->analyzeTailCalls(fnName, false, info);
+            if (Step)
+                Step->analyzeTailCalls(fnName, false, info);
+            Body->analyzeTailCalls(fnName, false, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            Start->collectCallees(callees);
+            End->collectCallees(callees);
+            if (Step)
+                Step->collectCallees(callees);
+            Body->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
+        Value *codegen() override;
+    };
+
+    // LetBinding - letやvarの`x = e`の一つ
+    struct LetBinding {
+        Symbol name;
+        ExprAST *init;
+    };
+
+    // LetExprAST - `let x = e1, y = e2 in body`と`var x = e1 in body`を表すクラス
+    // 変数は前から順に束縛し、各eからはそれより前の変数が見える。変数はbodyの中だけで見え、
+    // bodyの値が全体の値になる。
+    // letの変数は値そのものを指す名前で、varの変数には`x = e`で代入できる。
+    class LetExprAST : public ExprAST {
+        MutableArrayRef<LetBinding> bindings;
+        ExprAST *Body;
+        // varならtrue
+        bool isMutable;
+
+        public:
+        static const ASTNodeKind Kind = NODE_LET;
+
+        LetExprAST(MutableArrayRef<LetBinding> bindings, ExprAST *Body, bool isMutable)
+            : bindings(bindings), Body(Body), isMutable(isMutable) {}
+
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            for (const LetBinding &binding : bindings)
+                binding.init->analyzeTailCalls(fnName, false, info);
+            Body->analyzeTailCalls(fnName, isTail, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            for (const LetBinding &binding : bindings)
+                binding.init->collectCallees(callees);
+            Body->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
+        Value *codegen() override;
+    };
+
+    // AssignExprAST - varの変数への代入`x = e`を表すクラス。代入した値がこのexpressionの値になる。
+    class AssignExprAST : public ExprAST {
+        Symbol varName;
+        ExprAST *StoreValue;
+
+        public:
+        static const ASTNodeKind Kind = NODE_ASSIGN;
+
+        AssignExprAST(Symbol varName, ExprAST *StoreValue)
+            : varName(varName), StoreValue(StoreValue) {}
+
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            StoreValue->analyzeTailCalls(fnName, false, info);
+        }
+        void collectCallees(std::set<Symbol> &callees) override {
+            StoreValue->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
+        Value *codegen() override;
+    };
+
+    // SeqExprAST - `(e1; e2; e3)`を表すクラス。順番に計算し、最後のexpressionの値を値にする。
+    // 代入をした後に変数を読む時等に使う。
+    class SeqExprAST : public ExprAST {
+        MutableArrayRef<ExprAST *> Exprs;
 
         public:
-        IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-                std::unique_ptr<ExprAST> Else)
-            : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+        static const ASTNodeKind Kind = NODE_SEQ;
+
+        SeqExprAST(MutableArrayRef<ExprAST *> Exprs) : Exprs(Exprs) {}
 
-        NumType checkType() override {
-            return returnType(Then->checkType(), Else->checkType());
+        bool analyze(Sema &S) override;
+        void hash(ASTHasher &H) override;
+        void analyzeTailCalls(Symbol fnName, bool isTail,
+                TailCallInfo &info) override {
+            for (size_t i = 0; i < Exprs.size(); i++)
+                Exprs[i]->analyzeTailCalls(fnName, isTail && i + 1 == Exprs.size(), info);
         }
+        void collectCallees(std::set<Symbol> &callees) override {
+            for (ExprAST *E : Exprs)
+                E->collectCallees(callees);
+        }
+        bool evaluate(ConstEvaluator &ev, ConstValue &result) override;
+        bool foldConstants() override;
         Value *codegen() override;
     };
 } // end anonymous namespace
@@ -151,62 +609,78 @@ namespace {
 // CurTokは現在のトークン(tok_number, tok_eof, または')'や'+'などの場合そのascii)が
 // 格納されている。
 // getNextTokenにより次のトークンを読み、Curtokを更新する。
-static int CurTok;
-static int getNextToken() { return CurTok = lexer.gettok(); }
-
-// 二項演算子の結合子をmc.cppで定義している。
-static std::map<std::string, int> BinopPrecedence;
+static thread_local int CurTok;
+static int getNextToken() {
+    Stats.tokens++;
+    return CurTok = lexer.gettok();
+}
 
 // GetTokPrecedence - 二項演算子の結合度を取得
 // もし現在のトークンが二項演算子ならその結合度を返し、そうでないなら-1を返す。
+// 結合度はlexer.hのBinOpPrecedenceで定義している。
 static int GetTokPrecedence() {
     if (CurTok != tok_op)
         return -1;
-    std::string op = lexer.getOperand();
-    if (BinopPrecedence.count(op) == 0) 
-        return -1;
-
-    int tokprec = BinopPrecedence[op];
-    if (tokprec <= 0)
-        return -1;
-    return tokprec;
+    return getPrecedence(lexer.getBinOp());
 }
 
 // LogError - エラーを表示しnullptrを返してくれるエラーハンドリング関数
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "\e[31mError: %s\e[m\n", Str);
+ExprAST *LogError(const char *Str) {
+    diags() << "\e[31mError: " << Str << "\e[m\n";
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
+PrototypeAST *LogErrorP(const char *Str) {
+    diags() << "Error: " << Str << "\n";
     return nullptr;
 }
 
+void LogWarning(const std::string &str) {
+    diags() << "\e[33mWarning: " << str << "\e[m\n";
+}
+
 // Forward declaration
-static std::unique_ptr<ExprAST> ParseExpression();
+static ExprAST *ParseExpression();
+static ExprAST *ParsePrimary();
 
 // 数値リテラルをパースする関数。
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
+static ExprAST *ParseNumberExpr() {
     // NumberASTのValにlexerからnumValを読んできて、セットする。
     if (CurTok == tok_int_number) {
-        auto Result = llvm::make_unique<NumberAST>((int)lexer.getIntVal());
+        auto Result = ASTCtx.create<NumberAST>((int64_t)lexer.getIntVal());
         getNextToken(); // トークンを一個進めて、returnする。
-        return std::move(Result);
+        return Result;
     } else if (CurTok == tok_double_number){
-        auto Result = llvm::make_unique<NumberAST>((double)lexer.getDoubleVal());
+        auto Result = ASTCtx.create<NumberAST>((double)lexer.getDoubleVal());
         getNextToken(); // トークンを一個進めて、returnする。
-        return std::move(Result);
+        return Result;
     } else {
         return LogError("This is NaN");
     }
 }
 
+// ParseBoolExpr - trueかfalseをパースする。
+static ExprAST *ParseBoolExpr() {
+    auto Result = ASTCtx.create<NumberAST>(CurTok == tok_true);
+    getNextToken(); // eat true/false.
+    return Result;
+}
+
+// ParseNotExpr - `!e`をパースする。CurTokは"!"。
+// !は二項演算子より強く結合するので、オペランドはParsePrimaryで読む。
+static ExprAST *ParseNotExpr() {
+    getNextToken(); // eat !.
+    auto operand = ParsePrimary();
+    if (!operand)
+        return nullptr;
+    return ASTCtx.create<NotExprAST>(operand);
+}
+
 // TODO 1.5: 括弧を実装してみよう
 // 括弧は`'(' ExprAST ')'`の形で表されます。最初の'('を読んだ後、次のトークンは
 // ExprAST(NumberAST or BinaryAST)のはずなのでそれをパースし、最後に')'で有ることを
 // 確認します。
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+static ExprAST *ParseParenExpr() {
     // 1. ParseParenExprが呼ばれた時、CurTokは'('のはずなので、括弧の中身を得るために
     //    トークンを進めます。e.g. getNextToken()
     // 2. 現在のトークンはExprASTのはずなので、ParseExpression()を呼んでパースします。
@@ -221,27 +695,90 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
     if (!V)
         return nullptr;
 
+    // `(e1; e2; ...)`の場合はSeqExprASTにする。
+    if (CurTok == ';') {
+        SmallVector<ExprAST *, 4> exprs;
+        exprs.push_back(V);
+        while (CurTok == ';') {
+            getNextToken(); // eat ;.
+            auto E = ParseExpression();
+            if (!E)
+                return nullptr;
+            exprs.push_back(E);
+        }
+        V = ASTCtx.create<SeqExprAST>(ASTCtx.copyArray<ExprAST *>(exprs));
+    }
+
     if (CurTok != ')')
         return LogError("expected ')'");
     getNextToken(); // eat ).
     return V;
 }
 
+// lookupBuiltin - 名前が組み込み関数ならその種類を、そうでなければBUILTIN_NONEを返す。
+static Builtin lookupBuiltin(Symbol name) {
+    return StringSwitch<Builtin>(Symbols.getName(name))
+        .Case("len", BUILTIN_LEN)
+        .Case("broadcast", BUILTIN_BROADCAST)
+        .Case("shuffle", BUILTIN_SHUFFLE)
+        .Case("select", BUILTIN_SELECT)
+        .Case("hadd", BUILTIN_HADD)
+        .Case("hmul", BUILTIN_HMUL)
+        .Case("hmin", BUILTIN_HMIN)
+        .Case("hmax", BUILTIN_HMAX)
+        .Case("load", BUILTIN_LOAD)
+        .Case("store", BUILTIN_STORE)
+        .Default(BUILTIN_NONE);
+}
+
+// ParseIndexExpr - `xs[i]`か`xs[i] = e`をパースする。CurTokは'['。
+static ExprAST *ParseIndexExpr(Symbol arrayName) {
+    getNextToken(); // eat [.
+    auto index = ParseExpression();
+    if (!index)
+        return nullptr;
+    if (CurTok != ']')
+        return LogError("expected ']'");
+    getNextToken(); // eat ].
+
+    ExprAST *value = nullptr;
+    if (CurTok == tok_op && lexer.getOperand() == "=") {
+        getNextToken(); // eat =.
+        value = ParseExpression();
+        if (!value)
+            return nullptr;
+    }
+    return ASTCtx.create<IndexExprAST>(arrayName, index, value);
+}
+
 // TODO 2.2: 識別子をパースしよう
 // トークンが識別子の場合は、引数(変数)の参照か関数の呼び出しの為、
 // 引数の参照である場合はVariableExprASTを返し、関数呼び出しの場合は
 // CallExprASTを返す。
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
+static ExprAST *ParseIdentifierExpr() {
     // 1. getIdentifierを用いて識別子を取得する。
-    std::string IdName = lexer.getIdentifier();
+    Symbol IdName = lexer.getSymbol();
 
     // 2. トークンを次に進める。
     getNextToken();
 
+    // 次のトークンが'['の場合は配列の要素。その後に'='が続けば要素への代入。
+    if (CurTok == '[')
+        return ParseIndexExpr(IdName);
+
+    // 次のトークンが'='の場合はvarの変数への代入。
+    if (CurTok == tok_op && lexer.getOperand() == "=") {
+        getNextToken(); // eat =.
+        auto value = ParseExpression();
+        if (!value)
+            return nullptr;
+        return ASTCtx.create<AssignExprAST>(IdName, value);
+    }
+
     // 3. 次のトークンが'('の場合は関数呼び出し。そうでない場合は、
     // VariableExprASTを識別子を入れてインスタンス化し返す。
     if (CurTok != '(')
-        return llvm::make_unique<VariableExprAST>(IdName);
+        return ASTCtx.create<VariableExprAST>(IdName);
 
     // 4. '('を読んでトークンを次に進める。
     getNextToken();
@@ -251,11 +788,11 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     // ParseExpressionを用いる。
     // 呼び出しが終わるまで(CurTok == ')'になるまで)引数をパースしていき、都度argsにpush_backする。
     // 呼び出しの終わりと引数同士の区切りはCurTokが')'であるか','であるかで判別できることに注意。
-    std::vector<std::unique_ptr<ExprAST>> args;
+    SmallVector<ExprAST *, 8> args;
     if (CurTok != ')') {
         while (true) {
             if (auto val = ParseExpression())
-                args.push_back(std::move(val));
+                args.push_back(val);
             else
                 return nullptr;
 
@@ -271,11 +808,14 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     // 6. トークンを次に進める。
     getNextToken();
 
-    // 7. CallExprASTを構成し、返す。
-    return llvm::make_unique<CallExprAST>(IdName, std::move(args));
+    // 7. CallExprASTを構成し、返す。引数の配列はASTContextにコピーする。
+    // 組み込み関数の場合はBuiltinCallASTにする。
+    if (Builtin builtin = lookupBuiltin(IdName))
+        return ASTCtx.create<BuiltinCallAST>(builtin, ASTCtx.copyArray<ExprAST *>(args));
+    return ASTCtx.create<CallExprAST>(IdName, ASTCtx.copyArray<ExprAST *>(args));
 }
 
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+static ExprAST *ParseIfExpr() {
     // return nullptr;
     // TODO 3.3: If文のパーシングを実装してみよう。
     // 1. ParseIfExprに来るということは現在のトークンが"if"なので、
@@ -314,12 +854,115 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
         return LogError("no expression after 'else'");
     }
     // 7. IfExprASTを作り、returnします。
-    return llvm::make_unique<IfExprAST>(std::move(cond), std::move(expr1), std::move(expr2));
+    return ASTCtx.create<IfExprAST>(cond, expr1, expr2);
 
 }
 
+// ParseForExpr - `for [ヒント...] i = start, end[, step] in body`をパースする。
+static ExprAST *ParseForExpr() {
+    getNextToken(); // eat for.
+
+    // ループ変数の前に書かれた識別子はループの最適化のヒント。
+    // vectorize: ベクトル化を強制する
+    // unroll N:  N回展開する
+    bool vectorize = false;
+    unsigned unrollCount = 0;
+    Symbol varName;
+    while (true) {
+        if (CurTok != tok_identifier)
+            return LogError("expected identifier after 'for'");
+        varName = lexer.getSymbol();
+        StringRef word = lexer.getIdentifier();
+        bool isVectorize = word == "vectorize";
+        bool isUnroll = word == "unroll";
+        std::string hint = word.str();
+        getNextToken();
+
+        if (CurTok == tok_op && lexer.getOperand() == "=")
+            break;
+        if (isVectorize) {
+            vectorize = true;
+        } else if (isUnroll) {
+            if (CurTok != tok_int_number || lexer.getIntVal() < 1)
+                return LogError("expected a positive count after 'unroll'");
+            unrollCount = (unsigned)lexer.getIntVal();
+            getNextToken();
+        } else if (CurTok == tok_identifier) {
+            return LogError(("Unknown loop hint '" + hint + "'").c_str());
+        } else {
+            return LogError("expected '=' after the loop variable of 'for'");
+        }
+    }
+    getNextToken(); // eat =.
+
+    auto start = ParseExpression();
+    if (!start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after the start value of 'for'");
+    getNextToken();
+
+    auto end = ParseExpression();
+    if (!end)
+        return nullptr;
+
+    // stepは省略できる。
+    ExprAST *step = nullptr;
+    if (CurTok == ',') {
+        getNextToken();
+        step = ParseExpression();
+        if (!step)
+            return nullptr;
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after 'for'");
+    getNextToken();
+
+    auto body = ParseExpression();
+    if (!body)
+        return nullptr;
+    return ASTCtx.create<ForExprAST>(varName, start, end, step, body, vectorize, unrollCount);
+}
+
+// ParseLetExpr - `let x = e1, y = e2 in body`か`var x = e1 in body`をパースする。
+static ExprAST *ParseLetExpr() {
+    bool isMutable = CurTok == tok_var;
+    const char *keyword = isMutable ? "var" : "let";
+    getNextToken(); // eat let/var.
+
+    SmallVector<LetBinding, 4> bindings;
+    while (true) {
+        if (CurTok != tok_identifier)
+            return LogError(("expected identifier after '" + std::string(keyword) + "'").c_str());
+        Symbol name = lexer.getSymbol();
+        getNextToken();
+        if (CurTok != tok_op || lexer.getOperand() != "=")
+            return LogError(("expected '=' after the variable of '" + std::string(keyword) +
+                        "'").c_str());
+        getNextToken(); // eat =.
+        auto init = ParseExpression();
+        if (!init)
+            return nullptr;
+        bindings.push_back({name, init});
+
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat ,.
+    }
+
+    if (CurTok != tok_in)
+        return LogError(("expected 'in' after '" + std::string(keyword) + "'").c_str());
+    getNextToken();
+
+    auto body = ParseExpression();
+    if (!body)
+        return nullptr;
+    return ASTCtx.create<LetExprAST>(ASTCtx.copyArray<LetBinding>(bindings), body, isMutable);
+}
+
 // ParsePrimary - NumberASTか括弧をパースする関数
-static std::unique_ptr<ExprAST> ParsePrimary() {
+static ExprAST *ParsePrimary() {
     switch (CurTok) {
         default:
             return LogError("unknown token when expecting an expression");
@@ -328,10 +971,22 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
         case tok_int_number:
         case tok_double_number:
             return ParseNumberExpr();
+        case tok_true:
+        case tok_false:
+            return ParseBoolExpr();
+        case tok_op:
+            if (lexer.getOperand() == "!")
+                return ParseNotExpr();
+            return LogError("unknown token when expecting an expression");
         case '(':
             return ParseParenExpr();
         case tok_if:
             return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+        case tok_let:
+        case tok_var:
+            return ParseLetExpr();
     }
 }
 
@@ -339,8 +994,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 // このパーサーの中で一番重要と言っても良い、二項演算子のパーシングを実装します。
 // LHSに二項演算子の左側が入った状態で呼び出され、LHSとRHSと二項演算子がペアになった
 // 状態で返ります。
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int CallerPrec,
-        std::unique_ptr<ExprAST> LHS) {
+static ExprAST *ParseBinOpRHS(int CallerPrec, ExprAST *LHS) {
     while (true) {
         // 1. 現在の二項演算子の結合度を取得する。 e.g. int tokprec = GetTokPrecedence();
         int tokprec = GetTokPrecedence();
@@ -351,8 +1005,8 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int CallerPrec,
         if (tokprec < CallerPrec)
             return LHS;
 
-        // 3. 二項演算子をセットする。e.g. int BinOp = CurTok;
-        std::string BinOp = lexer.getOperand();
+        // 3. 二項演算子をセットする。e.g. BinOp Op = lexer.getBinOp();
+        BinOp Op = lexer.getBinOp();
 
         // 4. 次のトークン(二項演算子の右のexpression)に進む。
         getNextToken();
@@ -367,56 +1021,103 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int CallerPrec,
         // 呼んで先に次の二項演算子をパースする。
         int NextPrec = GetTokPrecedence();
         if (tokprec < NextPrec) {
-            RHS = ParseBinOpRHS(tokprec + 1, std::move(RHS));
+            RHS = ParseBinOpRHS(tokprec + 1, RHS);
             if (!RHS)
                 return nullptr;
         }
 
         // LHS, RHSをBinaryASTにしてLHSに代入する。
-        LHS = llvm::make_unique<BinaryAST>(BinOp, std::move(LHS), std::move(RHS));
+        LHS = ASTCtx.create<BinaryAST>(Op, LHS, RHS);
     }
 }
 
+// getTokType - 今のトークンが型(int, double, bool, double4等のベクトル型)ならその型を、
+// そうでなければDEFAULTを返す。
+static NumType getTokType() {
+    if (CurTok == tok_int)
+        return INT;
+    if (CurTok == tok_double)
+        return DOUBLE;
+    if (CurTok == tok_bool)
+        return BOOL;
+    if (CurTok == tok_identifier)
+        return lookupVectorType(lexer.getIdentifier());
+    return DEFAULT;
+}
+
 // TODO 2.3: 関数のシグネチャをパースしよう
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+static PrototypeAST *ParsePrototype() {
     // 2.2とほぼ同じ。CallExprASTではなくPrototypeASTを返し、
     // 引数同士の区切りが','ではなくgetNextToken()を呼ぶと直ぐに
     // CurTokに次の引数(もしくは')')が入るという違いのみ。
-    NumType retType;
-    if (CurTok == tok_int) {
-        retType = INT;
-    } else if (CurTok == tok_double) {
-        retType = DOUBLE;
-    } else {
-        return LogErrorP("Expected type of return value");
+
+    // 返り値の型の前に書かれた識別子は関数のアノテーション。
+    // tailrec: 自分自身を末尾位置でしか呼ばない事を保証する(そうでなければエラー)
+    // memo:    引数をキーにして結果をキャッシュする(純粋な関数でなければエラー)
+    // fpstrict, fpcontract, fpfast: 浮動小数点数の演算のモード(option.hのFPMode)
+    unsigned attrs = 0;
+    while (CurTok == tok_identifier && getTokType() == DEFAULT) {
+        StringRef attr = lexer.getIdentifier();
+        unsigned bit = StringSwitch<unsigned>(attr)
+            .Case("tailrec", ATTR_TAILREC)
+            .Case("memo", ATTR_MEMO)
+            .Case("fpstrict", ATTR_FP_STRICT)
+            .Case("fpcontract", ATTR_FP_CONTRACT)
+            .Case("fpfast", ATTR_FP_FAST)
+            .Default(0);
+        if (!bit) {
+            // "def myfunc(x y)"のように直後が'('なら、アノテーションではなく
+            // 返り値の型を書き忘れた関数名。
+            if (lexer.peekChar() == '(')
+                return LogErrorP("Expected type of return value");
+            return LogErrorP(("Unknown function annotation '" + attr.str() + "'").c_str());
+        }
+        if ((bit & ATTR_FP_MASK) && (attrs & ATTR_FP_MASK & ~bit))
+            return LogErrorP("Only one of fpstrict, fpcontract and fpfast can be specified");
+        attrs |= bit;
+        getNextToken();
     }
-    getNextToken();
+
+    NumType retType = getTokType();
+    if (retType == DEFAULT)
+        return LogErrorP("Expected type of return value");
+    if (getNextToken() == '[')
+        return LogErrorP("Functions cannot return arrays");
 
     if (CurTok != tok_identifier)
         return LogErrorP("Expected function name in prototype");
 
-    std::string FnName = lexer.getIdentifier();;
+    Symbol FnName = lexer.getSymbol();
+    if (lookupBuiltin(FnName))
+        return LogErrorP(("'" + lexer.getIdentifier().str() +
+                    "' is a builtin function and cannot be redefined").c_str());
     getNextToken();
 
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<ArgTuple> ArgList;
+    SmallVector<ArgTuple, 8> ArgList;
     while (getNextToken() != ')') {
         if (CurTok == ',') {
             getNextToken();
         }
-        NumType type;
-        std::string name;
-        if (CurTok == tok_int) {
-            type = INT;
-        } else if (CurTok == tok_double) {
-            type = DOUBLE;
-        } else {
+        Symbol name = EmptySymbol;
+        NumType type = getTokType();
+        if (type == DEFAULT)
             return LogErrorP("Expected type of argment");
+        // "int[] xs"のように型の後に"[]"があれば配列
+        if (getNextToken() == '[') {
+            if (isVectorType(type))
+                return LogErrorP("Arrays of vectors are not supported");
+            if (type == BOOL)
+                return LogErrorP("Arrays of bool are not supported");
+            if (getNextToken() != ']')
+                return LogErrorP("Expected ']' in array type");
+            type = getArrayType(type);
+            getNextToken();
         }
-        if (getNextToken() == tok_identifier) {
-            name = lexer.getIdentifier();
+        if (CurTok == tok_identifier) {
+            name = lexer.getSymbol();
         }
         ArgTuple curArg = {name, type};
         ArgList.push_back(curArg);
@@ -426,37 +1127,42 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     getNextToken();
     
 
-    return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgList), retType);
+    return ASTCtx.create<PrototypeAST>(FnName, ASTCtx.copyArray<ArgTuple>(ArgList),
+            retType, attrs);
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+static FunctionAST *ParseDefinition() {
     getNextToken();
     auto proto = ParsePrototype();
     if (!proto)
         return nullptr;
 
     if (auto E = ParseExpression())
-        return llvm::make_unique<FunctionAST>(std::move(proto), std::move(E));
+        return ASTCtx.create<FunctionAST>(proto, E);
     return nullptr;
 }
 
 // ExprASTは1. 数値リテラル 2. '('から始まる演算 3. 二項演算子の三通りが考えられる為、
 // 最初に1,2を判定して、そうでなければ二項演算子だと思う。
-static std::unique_ptr<ExprAST> ParseExpression() {
+static ExprAST *ParseExpression() {
     auto LHS = ParsePrimary();
     if (!LHS)
         return nullptr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
 }
 
-// パーサーのトップレベル関数。まだ関数定義は実装しないので、今のmc言語では
-// __anon_exprという関数がトップレベルに作られ、その中に全てのASTが入る。
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+// パーサーのトップレベル関数。関数定義の外に書かれたexpressionは、
+// __anon_exprNという引数の無い関数としてトップレベルに作られ、その中にASTが入る。
+// 名前は一つのModule(やJIT)の中で重複しないよう連番にする。
+// 返り値の型はbodyの型から決まるので、ここではDEFAULTにしておく。
+static thread_local int AnonExprCount = 0;
+static FunctionAST *ParseTopLevelExpr() {
     if (auto E = ParseExpression()) {
-        auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
-                std::vector<ArgTuple>(), INT);
-        return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = ASTCtx.create<PrototypeAST>(
+                Symbols.intern("__anon_expr" + std::to_string(AnonExprCount++)),
+                ArrayRef<ArgTuple>(), DEFAULT);
+        return ASTCtx.create<FunctionAST>(Proto, E);
     }
     return nullptr;
 }
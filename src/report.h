@@ -0,0 +1,71 @@
+//===----------------------------------------------------------------------===//
+// Report
+// --time-reportと--statsのための計測。
+// --time-reportでは、コンパイルの各フェーズの時間をllvm::Timerで測る。TimePhaseで
+// 囲んだ区間が入れ子になった場合は外側のタイマーを止めるので、各フェーズの時間は
+// 重複しない。字句解析はトークン毎にタイマーを動かすと遅すぎるので、構文解析の前に
+// 一度だけ全体を読んで測り、構文解析の時間には字句解析も含める。
+// --statsでは、トークンや関数の数等をCompileStatsに数える。
+//
+// どちらもコンパイル(ファイル)毎なのでthread_localにしており、
+// driver.hのprintReportがコンパイルの最後に表示する。
+//===----------------------------------------------------------------------===//
+
+// CompileStats - --statsで表示するカウンタ
+struct CompileStats {
+    uint64_t tokens = 0;
+    uint64_t functions = 0;
+    uint64_t irInstructions = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+};
+static thread_local CompileStats Stats;
+
+static thread_local TimerGroup PhaseTimers("mc", "MC compiler phases");
+static thread_local Timer LexTimer("lex", "Lexing (separate pass)", PhaseTimers);
+static thread_local Timer ParseTimer("parse", "Parsing (including lexing)", PhaseTimers);
+static thread_local Timer FoldTimer("fold", "Constant folding", PhaseTimers);
+static thread_local Timer SemaTimer("sema", "Semantic analysis", PhaseTimers);
+static thread_local Timer IRGenTimer("irgen", "IR generation", PhaseTimers);
+static thread_local Timer VerifyTimer("verify", "IR verification", PhaseTimers);
+static thread_local Timer CacheKeyTimer("cachekey", "Object cache keys", PhaseTimers);
+static thread_local Timer OptimizeTimer("optimize", "IR optimization", PhaseTimers);
+static thread_local Timer EmitTimer("emit", "Object emission", PhaseTimers);
+static thread_local Timer PartitionTimer("partition",
+        "Optimization and emission of partitions (-j, --cache)", PhaseTimers);
+
+// LLVMのパス毎の時間。--time-reportで、かつ一つのスレッドでコンパイルする場合だけ作る。
+// (-jでは各スレッドのパスの時間が一つの表に混ざってしまうため。)
+static thread_local std::unique_ptr<TimePassesHandler> PassTimes;
+
+// 今動いているフェーズのタイマー
+static thread_local Timer *CurrentPhase = nullptr;
+
+// TimePhase - このスコープの間、timerを動かす。
+class TimePhase {
+    public:
+        TimePhase(Timer &T) {
+            if (!TimeReport)
+                return;
+            timer = &T;
+            outer = CurrentPhase;
+            if (outer)
+                outer->stopTimer();
+            timer->startTimer();
+            CurrentPhase = timer;
+        }
+        ~TimePhase() {
+            if (!timer)
+                return;
+            timer->stopTimer();
+            CurrentPhase = outer;
+            if (outer)
+                outer->startTimer();
+        }
+        TimePhase(const TimePhase &) = delete;
+        void operator=(const TimePhase &) = delete;
+
+    private:
+        Timer *timer = nullptr;
+        Timer *outer = nullptr;
+};
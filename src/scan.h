@@ -0,0 +1,213 @@
+//===----------------------------------------------------------------------===//
+// Scanner
+// Lexerが一番時間を使うのは、インデントの空白、コメント、長い識別子を一文字ずつ
+// 読み飛ばすループである。このセクションではそれらを16〜32バイトずつまとめて
+// 調べるSIMD版(SSE2/AVX2)と、一文字ずつ調べるスカラー版を用意し、起動時に
+// CPUを判定して使える中で一番速いものを選ぶ。
+//
+// どの関数もpから読み始めて、条件を満たさない最初の文字へのポインタを返す。
+// バッファの末尾には必ず'\0'があり、'\0'はどの条件も満たさないので、そこで止まる。
+//
+// SIMD版はアラインされたブロック単位で読むので、'\0'の後ろ(や、pの前)の数バイトを
+// 読むことがある。アラインされたロードはページ境界をまたがないため、読んだ先が
+// マップされていないことは無いが、結果にはpから'\0'までしか使わない。
+//===----------------------------------------------------------------------===//
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MC_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Scanner - 読み飛ばし関数の一式。
+struct Scanner {
+    const char *name;
+    // 空白(' ', '\t', '\n', '\v', '\f', '\r')を読み飛ばす
+    const char *(*skipSpace)(const char *p);
+    // 行末('\n')か'\0'まで読み飛ばす
+    const char *(*skipLine)(const char *p);
+    // 英数字([0-9A-Za-z])を読み飛ばす
+    const char *(*skipAlnum)(const char *p);
+};
+
+//===----------------------------------------------------------------------===//
+// スカラー版
+//===----------------------------------------------------------------------===//
+
+static inline bool isSpaceChar(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool isAlnumChar(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+static const char *skipSpaceScalar(const char *p) {
+    while (isSpaceChar(*p))
+        p++;
+    return p;
+}
+
+static const char *skipLineScalar(const char *p) {
+    while (*p != '\n' && *p != '\0')
+        p++;
+    return p;
+}
+
+static const char *skipAlnumScalar(const char *p) {
+    while (isAlnumChar(*p))
+        p++;
+    return p;
+}
+
+#ifdef MC_SCAN_X86
+//===----------------------------------------------------------------------===//
+// SSE2版 (x86-64では常に使える)
+// 各関数は16バイトの中で「止まるべき文字」の位置をビットマスクにし、
+// 最下位の立っているビットが止まる位置になる。
+//===----------------------------------------------------------------------===//
+
+// 各バイトがlo以上hi以下ならFFになるマスク。文字は全て0x80未満なので、
+// 符号付き比較で0x80以上のバイトは範囲外になる。
+static inline __m128i inRange16(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+            _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+}
+
+static inline unsigned spaceStop16(__m128i v) {
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+            inRange16(v, '\t', '\r'));
+    return ~(unsigned)_mm_movemask_epi8(space) & 0xFFFF;
+}
+
+static inline unsigned lineStop16(__m128i v) {
+    __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+            _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(stop);
+}
+
+static inline unsigned alnumStop16(__m128i v) {
+    // 0x20を立てると大文字が小文字になる(英字以外が英字の範囲に入ることは無い)
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alnum = _mm_or_si128(inRange16(v, '0', '9'), inRange16(lower, 'a', 'z'));
+    return ~(unsigned)_mm_movemask_epi8(alnum) & 0xFFFF;
+}
+
+// SCAN_SSE2 - pを含むアラインされたブロックから、stop関数のマスクが0で無くなるまで読む。
+#define SCAN_SSE2(p, stop)                                                    \
+    do {                                                                      \
+        uintptr_t offset = (uintptr_t)(p) & 15;                               \
+        const char *block = (p) - offset;                                     \
+        unsigned mask = stop(_mm_load_si128((const __m128i *)block)) >> offset; \
+        if (mask)                                                             \
+            return (p) + __builtin_ctz(mask);                                 \
+        while (true) {                                                        \
+            block += 16;                                                      \
+            mask = stop(_mm_load_si128((const __m128i *)block));              \
+            if (mask)                                                         \
+                return block + __builtin_ctz(mask);                           \
+        }                                                                     \
+    } while (0)
+
+static const char *skipSpaceSSE2(const char *p) {
+    // トークンの間の空白は0か1文字のことがほとんどなので、先にスカラーで確認する。
+    if (!isSpaceChar(p[0]))
+        return p;
+    if (!isSpaceChar(p[1]))
+        return p + 1;
+    SCAN_SSE2(p, spaceStop16);
+}
+
+static const char *skipLineSSE2(const char *p) {
+    SCAN_SSE2(p, lineStop16);
+}
+
+static const char *skipAlnumSSE2(const char *p) {
+    SCAN_SSE2(p, alnumStop16);
+}
+
+//===----------------------------------------------------------------------===//
+// AVX2版
+// 32バイト単位で読む以外はSSE2版と同じ。コンパイル時に-mavx2が無くても使えるよう、
+// 関数毎にtarget属性を付けている。
+//===----------------------------------------------------------------------===//
+
+#define MC_AVX2 __attribute__((target("avx2")))
+
+MC_AVX2 static inline __m256i inRange32(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+MC_AVX2 static inline uint64_t spaceStop32(__m256i v) {
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+            inRange32(v, '\t', '\r'));
+    return ~(uint32_t)_mm256_movemask_epi8(space) & 0xFFFFFFFFull;
+}
+
+MC_AVX2 static inline uint64_t lineStop32(__m256i v) {
+    __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return (uint32_t)_mm256_movemask_epi8(stop);
+}
+
+MC_AVX2 static inline uint64_t alnumStop32(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alnum = _mm256_or_si256(inRange32(v, '0', '9'), inRange32(lower, 'a', 'z'));
+    return ~(uint32_t)_mm256_movemask_epi8(alnum) & 0xFFFFFFFFull;
+}
+
+#define SCAN_AVX2(p, stop)                                                    \
+    do {                                                                      \
+        uintptr_t offset = (uintptr_t)(p) & 31;                               \
+        const char *block = (p) - offset;                                     \
+        uint64_t mask = stop(_mm256_load_si256((const __m256i *)block)) >> offset; \
+        if (mask)                                                             \
+            return (p) + __builtin_ctzll(mask);                               \
+        while (true) {                                                        \
+            block += 32;                                                      \
+            mask = stop(_mm256_load_si256((const __m256i *)block));           \
+            if (mask)                                                         \
+                return block + __builtin_ctzll(mask);                         \
+        }                                                                     \
+    } while (0)
+
+MC_AVX2 static const char *skipSpaceAVX2(const char *p) {
+    if (!isSpaceChar(p[0]))
+        return p;
+    if (!isSpaceChar(p[1]))
+        return p + 1;
+    SCAN_AVX2(p, spaceStop32);
+}
+
+MC_AVX2 static const char *skipLineAVX2(const char *p) {
+    SCAN_AVX2(p, lineStop32);
+}
+
+MC_AVX2 static const char *skipAlnumAVX2(const char *p) {
+    SCAN_AVX2(p, alnumStop32);
+}
+#endif // MC_SCAN_X86
+
+static const Scanner ScalarScanner = {
+    "scalar", skipSpaceScalar, skipLineScalar, skipAlnumScalar};
+#ifdef MC_SCAN_X86
+static const Scanner SSE2Scanner = {
+    "sse2", skipSpaceSSE2, skipLineSSE2, skipAlnumSSE2};
+static const Scanner AVX2Scanner = {
+    "avx2", skipSpaceAVX2, skipLineAVX2, skipAlnumAVX2};
+#endif
+
+// selectScanner - 実行中のCPUで使える一番速いScannerを返す。
+static const Scanner *selectScanner() {
+#ifdef MC_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &AVX2Scanner;
+    if (__builtin_cpu_supports("sse2"))
+        return &SSE2Scanner;
+#endif
+    return &ScalarScanner;
+}
+
+// Lexerが使うScanner。ベンチマーク等で差し替えられるようにポインタで持つ。
+static const Scanner *TheScanner = selectScanner();
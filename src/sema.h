@@ -0,0 +1,465 @@
+//===----------------------------------------------------------------------===//
+// Semantic Analysis
+// codegenの前に関数のASTを一度だけ辿り、各ノードの型(ExprAST::type)と
+// 関数呼び出しの呼び出し先(CallExprAST::calleeProto)を決めておく。
+// 型のエラーはここで全て見つけるので、codegenは決まった型を読むだけでよい。
+//
+// 呼び出し先はLLVMのModuleではなく、これまでに定義された関数のシグネチャの表
+// (FunctionProtos)から引く。JITでModuleが変わっても表はそのまま使える。
+//===----------------------------------------------------------------------===//
+
+// これまでに定義された関数のシグネチャ。
+static thread_local DenseMap<Symbol, PrototypeAST *> FunctionProtos;
+
+// Sema - 関数一つ分の意味解析の状態
+class Sema {
+    public:
+        Sema(ArrayRef<ArgTuple> params) : params(params) {}
+
+        // 変数の型を探す。内側のスコープ(ループ変数やletの変数)から順に、最後に関数の引数を探す。
+        // isMutableが指定されていれば、varの変数(代入できる)かどうかもセットする。
+        // 変数は高々数個なので線形探索する。
+        bool lookup(Symbol name, NumType &type, bool *isMutable = nullptr) {
+            for (auto I = locals.rbegin(), E = locals.rend(); I != E; ++I) {
+                if (I->name == name) {
+                    type = I->type;
+                    if (isMutable)
+                        *isMutable = I->isMutable;
+                    return true;
+                }
+            }
+            for (const ArgTuple &param : params) {
+                if (param.name == name) {
+                    type = param.type;
+                    if (isMutable)
+                        *isMutable = false;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // ループ変数等のスコープに変数を出し入れする。
+        void pushLocal(Symbol name, NumType type, bool isMutable = false) {
+            locals.push_back({name, type, isMutable});
+        }
+        void popLocal() { locals.pop_back(); }
+
+    private:
+        struct LocalVar {
+            Symbol name;
+            NumType type;
+            bool isMutable;
+        };
+        ArrayRef<ArgTuple> params;
+        SmallVector<LocalVar, 4> locals;
+};
+
+// getTypeName - エラーメッセージ用の型の名前
+static const char *getTypeName(NumType type) {
+    switch (type) {
+        case INT: return "int";
+        case DOUBLE: return "double";
+        case BOOL: return "bool";
+        case INT_ARRAY: return "int[]";
+        case DOUBLE_ARRAY: return "double[]";
+        default:
+            if (const VectorTypeInfo *info = getVectorTypeInfo(type))
+                return info->name;
+            return "unknown";
+    }
+}
+
+// checkScalar - 配列はIndexExprAST, 組み込み関数(len, load, store), 関数呼び出しの
+// 引数にしか使えないので、それ以外の場所(whatで表す)に配列が来たらエラーにする。
+// このため、配列の型を持つexpressionは常にVariableExprASTになる。
+static bool checkScalar(ExprAST *E, const char *what) {
+    if (!isArrayType(E->type))
+        return true;
+    LogError(("an array cannot be used as " + std::string(what)).c_str());
+    return false;
+}
+
+bool NumberAST::analyze(Sema &S) {
+    return true;
+}
+
+bool VariableExprAST::analyze(Sema &S) {
+    if (!S.lookup(variableName, type)) {
+        LogError("Unknown variable name");
+        return false;
+    }
+    return true;
+}
+
+bool BinaryAST::analyze(Sema &S) {
+    // 両方を解析して、エラーはまとめて報告する。
+    bool okL = LHS->analyze(S);
+    bool okR = RHS->analyze(S);
+    if (!okL || !okR)
+        return false;
+    if (!checkScalar(LHS, "an operand") || !checkScalar(RHS, "an operand"))
+        return false;
+
+    // &&と||はboolにしか使えない。
+    if (isLogical(Op) && (LHS->type != BOOL || RHS->type != BOOL)) {
+        LogError("the operands of '&&' and '||' must be 'bool'");
+        return false;
+    }
+    // 左右の型が食い違っている場合はエラー(ベクトルとスカラーの演算にはbroadcastを使う)
+    if (LHS->type != RHS->type) {
+        LogError(("cannot operate between '" + std::string(getTypeName(LHS->type)) + "' and '" +
+                    getTypeName(RHS->type) + "'").c_str());
+        return false;
+    }
+    if (Op == BinOp::Invalid) {
+        LogError("invalid binary operator");
+        return false;
+    }
+    // boolには&&, ||, ==, !=しか使えない。
+    if (LHS->type == BOOL && !isLogical(Op) && Op != BinOp::EQ && Op != BinOp::NE) {
+        LogError("only '&&', '||', '==' and '!=' can be used on 'bool'");
+        return false;
+    }
+    // ベクトルの比較は要素毎に行い、結果は同じ要素数のintのベクトル(マスク)になる。
+    // 各要素は真なら-1(全てのビットが1)、偽なら0。スカラーの比較の結果はbool。
+    if (isVectorType(LHS->type) && isComparison(Op))
+        type = getVectorType(INT, getVectorWidth(LHS->type));
+    else if (isComparison(Op))
+        type = BOOL;
+    else
+        type = LHS->type;
+    return true;
+}
+
+bool NotExprAST::analyze(Sema &S) {
+    if (!Operand->analyze(S))
+        return false;
+    if (Operand->type != BOOL) {
+        LogError(("the operand of '!' must be 'bool', not '" +
+                    std::string(getTypeName(Operand->type)) + "'").c_str());
+        return false;
+    }
+    type = BOOL;
+    return true;
+}
+
+bool CallExprAST::analyze(Sema &S) {
+    auto FI = FunctionProtos.find(callee);
+    if (FI == FunctionProtos.end()) {
+        LogError("Unknown function referenced");
+        return false;
+    }
+    calleeProto = FI->second;
+
+    ArrayRef<ArgTuple> params = calleeProto->getArgs();
+    if (params.size() != ArgList.size()) {
+        LogError("Incorrect number of arguments passed");
+        return false;
+    }
+
+    for (size_t i = 0; i < ArgList.size(); i++) {
+        if (!ArgList[i]->analyze(S))
+            return false;
+        //関数で定義されている型と、実際に呼び出しで指定された値の型が一致しない場合
+        if (params[i].type != ArgList[i]->type) {
+            LogError("cannot assign the value to this function");
+            return false;
+        }
+    }
+
+    // 配列の引数はnoaliasなので、同じ配列を二つの引数に渡すことはできない。
+    // (配列は関数の引数からしか来ず、引数同士もnoaliasなので、重なるのはこの場合だけ。)
+    for (size_t i = 0; i < ArgList.size(); i++) {
+        if (!isArrayType(ArgList[i]->type))
+            continue;
+        Symbol name = static_cast<VariableExprAST *>(ArgList[i])->getName();
+        for (size_t j = i + 1; j < ArgList.size(); j++) {
+            if (isArrayType(ArgList[j]->type) &&
+                    static_cast<VariableExprAST *>(ArgList[j])->getName() == name) {
+                LogError(("array '" + Symbols.getName(name).str() +
+                            "' cannot be passed to more than one parameter").c_str());
+                return false;
+            }
+        }
+    }
+    type = calleeProto->getType();
+    return true;
+}
+
+bool IfExprAST::analyze(Sema &S) {
+    if (!Cond->analyze(S))
+        return false;
+    // 条件は普通はboolだが、以前のプログラムのためにintとdoubleも受け付け、0でなければ真にする。
+    if (Cond->type != BOOL && Cond->type != INT && Cond->type != DOUBLE) {
+        LogError("illegal type of condition");
+        return false;
+    }
+
+    bool okT = Then->analyze(S);
+    bool okE = Else->analyze(S);
+    if (!okT || !okE)
+        return false;
+    if (!checkScalar(Then, "the value of 'if'") || !checkScalar(Else, "the value of 'if'"))
+        return false;
+    if (Then->type != Else->type) {
+        LogError(("Cannot convert '" + std::string(getTypeName(Else->type)) + "' to '" +
+                    getTypeName(Then->type) +
+                    "'. Please set same type in THEN value and ELSE value.").c_str());
+        return false;
+    }
+    type = Then->type;
+    return true;
+}
+
+bool ForExprAST::analyze(Sema &S) {
+    bool okS = Start->analyze(S);
+    bool okE = End->analyze(S);
+    bool okT = !Step || Step->analyze(S);
+    if (!okS || !okE || !okT)
+        return false;
+    if (Start->type != INT && Start->type != DOUBLE) {
+        LogError("the start value of 'for' must be 'int' or 'double'");
+        return false;
+    }
+    if (End->type != Start->type || (Step && Step->type != Start->type)) {
+        LogError("the end and step of 'for' must have the same type as the start value");
+        return false;
+    }
+
+    // ループ変数はbodyの中だけで見える。
+    S.pushLocal(varName, Start->type);
+    bool ok = Body->analyze(S);
+    S.popLocal();
+    if (!ok || !checkScalar(Body, "the body of 'for'"))
+        return false;
+    // 値はbodyの合計なので、boolは足せない。
+    if (Body->type == BOOL) {
+        LogError("the body of 'for' cannot be 'bool'");
+        return false;
+    }
+    type = Body->type;
+    return true;
+}
+
+bool LetExprAST::analyze(Sema &S) {
+    // 各変数は次の変数の値とbodyから見える。
+    size_t numPushed = 0;
+    bool ok = true;
+    for (const LetBinding &binding : bindings) {
+        if (!binding.init->analyze(S) || !checkScalar(binding.init, "the value of a variable")) {
+            ok = false;
+            break;
+        }
+        S.pushLocal(binding.name, binding.init->type, isMutable);
+        numPushed++;
+    }
+    ok = ok && Body->analyze(S);
+    for (size_t i = 0; i < numPushed; i++)
+        S.popLocal();
+    if (!ok || !checkScalar(Body, isMutable ? "the body of 'var'" : "the body of 'let'"))
+        return false;
+    type = Body->type;
+    return true;
+}
+
+bool AssignExprAST::analyze(Sema &S) {
+    bool isMutable;
+    if (!S.lookup(varName, type, &isMutable)) {
+        LogError("Unknown variable name");
+        return false;
+    }
+    std::string name = Symbols.getName(varName).str();
+    if (!isMutable) {
+        LogError(("cannot assign to '" + name + "'; only variables declared with 'var' "
+                    "can be assigned").c_str());
+        return false;
+    }
+    if (!StoreValue->analyze(S))
+        return false;
+    if (StoreValue->type != type) {
+        LogError(("cannot assign '" + std::string(getTypeName(StoreValue->type)) +
+                    "' to '" + name + "' of type '" + getTypeName(type) + "'").c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SeqExprAST::analyze(Sema &S) {
+    for (ExprAST *E : Exprs) {
+        if (!E->analyze(S) || !checkScalar(E, "an element of '(...; ...)'"))
+            return false;
+    }
+    type = Exprs.back()->type;
+    return true;
+}
+
+bool IndexExprAST::analyze(Sema &S) {
+    NumType arrayType;
+    if (!S.lookup(arrayName, arrayType)) {
+        LogError("Unknown variable name");
+        return false;
+    }
+    if (!isArrayType(arrayType)) {
+        LogError(("'" + Symbols.getName(arrayName).str() + "' is not an array").c_str());
+        return false;
+    }
+    type = getElementType(arrayType);
+
+    if (!Index->analyze(S))
+        return false;
+    if (Index->type != INT) {
+        LogError("array index must be 'int'");
+        return false;
+    }
+
+    if (StoreValue) {
+        if (!StoreValue->analyze(S))
+            return false;
+        if (StoreValue->type != type) {
+            LogError(("cannot store '" + std::string(getTypeName(StoreValue->type)) +
+                        "' into an element of '" + getTypeName(arrayType) + "'").c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BuiltinCallAST::analyze(Sema &S) {
+    for (ExprAST *arg : ArgList) {
+        if (!arg->analyze(S))
+            return false;
+    }
+
+    auto error = [](const std::string &msg) {
+        LogError(msg.c_str());
+        return false;
+    };
+    // getCount - 要素数等の引数(整数のリテラル)の値
+    auto getCount = [&](ExprAST *E, int64_t &value) {
+        if (!E->isNumber() || E->type != INT)
+            return false;
+        value = static_cast<NumberAST *>(E)->getIntValue();
+        return true;
+    };
+    size_t numArgs = ArgList.size();
+
+    switch (builtin) {
+        case BUILTIN_LEN:
+            if (numArgs != 1 || !isArrayType(ArgList[0]->type))
+                return error("len expects one array argument");
+            type = INT;
+            return true;
+
+        case BUILTIN_BROADCAST: {
+            int64_t width;
+            if (numArgs != 2 || (ArgList[0]->type != INT && ArgList[0]->type != DOUBLE) ||
+                    !getCount(ArgList[1], width))
+                return error("broadcast expects a scalar and an integer literal");
+            type = getVectorType(ArgList[0]->type, width);
+            if (type == DEFAULT)
+                return error("there is no vector type of " + std::to_string(width) + " '" +
+                        getTypeName(ArgList[0]->type) + "'");
+            return true;
+        }
+
+        case BUILTIN_SHUFFLE: {
+            if (numArgs < 3 || !isVectorType(ArgList[0]->type) ||
+                    ArgList[1]->type != ArgList[0]->type)
+                return error("shuffle expects two vectors of the same type and indices");
+            NumType vecType = ArgList[0]->type;
+            int64_t limit = 2 * getVectorWidth(vecType);
+            for (size_t i = 2; i < numArgs; i++) {
+                int64_t index;
+                if (!getCount(ArgList[i], index) || index < 0 || index >= limit)
+                    return error("shuffle indices must be integer literals in [0, " +
+                            std::to_string(limit) + ")");
+            }
+            type = getVectorType(getScalarType(vecType), numArgs - 2);
+            if (type == DEFAULT)
+                return error("there is no vector type of " + std::to_string(numArgs - 2) +
+                        " '" + getTypeName(getScalarType(vecType)) + "'");
+            return true;
+        }
+
+        case BUILTIN_SELECT: {
+            if (numArgs != 3 || ArgList[1]->type != ArgList[2]->type ||
+                    isArrayType(ArgList[1]->type))
+                return error("select expects a mask and two values of the same type");
+            // ベクトルのマスクは比較の結果と同じintのベクトル、スカラーならbool。
+            NumType maskType = getVectorType(INT, getVectorWidth(ArgList[1]->type));
+            if (!isVectorType(ArgList[1]->type))
+                maskType = BOOL;
+            if (ArgList[0]->type != maskType)
+                return error(std::string("the mask of select must be '") +
+                        getTypeName(maskType) + "'");
+            type = ArgList[1]->type;
+            return true;
+        }
+
+        case BUILTIN_HADD:
+        case BUILTIN_HMUL:
+        case BUILTIN_HMIN:
+        case BUILTIN_HMAX:
+            if (numArgs != 1 || !isVectorType(ArgList[0]->type))
+                return error("reductions expect one vector argument");
+            type = getScalarType(ArgList[0]->type);
+            return true;
+
+        case BUILTIN_LOAD: {
+            int64_t width;
+            if (numArgs != 3 || !isArrayType(ArgList[0]->type) || ArgList[1]->type != INT ||
+                    !getCount(ArgList[2], width))
+                return error("load expects an array, an index and an integer literal");
+            NumType elem = getElementType(ArgList[0]->type);
+            type = getVectorType(elem, width);
+            if (type == DEFAULT)
+                return error("there is no vector type of " + std::to_string(width) + " '" +
+                        getTypeName(elem) + "'");
+            return true;
+        }
+
+        case BUILTIN_STORE:
+            if (numArgs != 3 || !isArrayType(ArgList[0]->type) || ArgList[1]->type != INT ||
+                    !isVectorType(ArgList[2]->type) ||
+                    getScalarType(ArgList[2]->type) != getElementType(ArgList[0]->type))
+                return error("store expects an array, an index and a vector of its elements");
+            type = ArgList[2]->type;
+            return true;
+
+        default:
+            return error("unknown builtin");
+    }
+}
+
+// FunctionAST::analyze - シグネチャを表に登録してbodyを解析する。
+// 返り値の型が決まっていない(top level expressionの)場合はbodyの型にする。
+bool FunctionAST::analyze() {
+    // 再帰呼び出しを解析できるように、bodyより先に登録する。
+    // 失敗した場合は以前の定義(あれば)に戻す。
+    Symbol Name = proto->getName();
+    prevProto = FunctionProtos.lookup(Name);
+    FunctionProtos[Name] = proto;
+
+    Sema S(proto->getArgs());
+    bool ok = body->analyze(S) && checkScalar(body, "the value of a function");
+    if (ok && proto->getType() == DEFAULT)
+        proto->setType(body->type);
+    if (ok && proto->getType() != body->type) {
+        //定義された返り値の型と、bodyの型が異なっていたらエラー
+        LogError("illegal definition of function. defined type of return value is different from body type.");
+        ok = false;
+    }
+
+    if (!ok)
+        restorePrototype();
+    return ok;
+}
+
+void FunctionAST::restorePrototype() {
+    Symbol Name = proto->getName();
+    if (prevProto)
+        FunctionProtos[Name] = prevProto;
+    else
+        FunctionProtos.erase(Name);
+}
@@ -0,0 +1,43 @@
+//===----------------------------------------------------------------------===//
+// Symbol
+// 識別子の文字列を整数のID(Symbol)に変換する表(interner)。
+// 同じ名前には必ず同じIDが振られるので、ASTやNamedValuesは文字列の代わりにIDを
+// 持ち、名前の比較は整数の比較で済む。文字列が必要な時(IRの名前を付ける時等)は
+// getNameで引く。
+//===----------------------------------------------------------------------===//
+
+typedef unsigned Symbol;
+
+// 空の名前のSymbol。SymbolTableが最初に登録するので常に0になる。
+static const Symbol EmptySymbol = 0;
+
+class SymbolTable {
+    public:
+        SymbolTable() { intern(""); }
+
+        // intern - nameのIDを返す。初めて見る名前なら新しいIDを振る。
+        Symbol intern(StringRef name) {
+            auto R = ids.insert(std::make_pair(name, (Symbol)names.size()));
+            if (R.second)
+                names.push_back(R.first->getKey());
+            return R.first->getValue();
+        }
+
+        // getName - IDの名前を返す。StringMapが文字列を持っているので、ずっと使える。
+        StringRef getName(Symbol id) const { return names[id]; }
+
+        size_t size() const { return names.size(); }
+
+        // clear - 全ての名前を消す。それまでのSymbolとStringRefは使えなくなる。
+        void clear() {
+            ids.clear();
+            names.clear();
+            intern("");
+        }
+
+    private:
+        StringMap<Symbol> ids;
+        std::vector<StringRef> names;
+};
+
+static thread_local SymbolTable Symbols;
@@ -0,0 +1,23 @@
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// ベクトルの引数の関数は呼ばず、配列の引数の関数だけを呼ぶ。
+extern "C" {
+    double sum4(const double *xs, int64_t n);
+    double axpy4(double a, const double *xs, int64_t n, double *ys, int64_t m);
+}
+
+int main() {
+    std::vector<double> xs = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0};
+    std::vector<double> ys(xs.size(), 0.5);
+
+    std::cout << "sum4 = " << sum4(xs.data(), xs.size()) << std::endl;
+    std::cout << "axpy4 = " << axpy4(2.0, xs.data(), xs.size(), ys.data(), ys.size()) << std::endl;
+    std::cout << "ys =";
+    for (double y : ys)
+        std::cout << " " << y;
+    std::cout << std::endl;
+
+    return 0;
+}